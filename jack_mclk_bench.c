@@ -0,0 +1,341 @@
+/* JACK MIDI Beat Clock Generator - process() micro-benchmark
+ *
+ * Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The generator is compiled into this file, and linked against
+ * the stub JACK API below instead of libjack. This gives direct
+ * access to its (static) process callback.
+ */
+#define main jack_midi_clock_main
+#include "jack_midi_clock.c"
+#undef main
+
+#include <time.h>
+#include <errno.h>
+
+/*****************************************************************************
+ * stub JACK API
+ */
+
+#define STUB_MAX_EVENTS 1024
+#define STUB_EVENT_SIZE 16 /**< max event size, MTC full frame is 10 bytes */
+
+struct stub_event {
+  jack_nframes_t   time;
+  size_t           size;
+  jack_midi_data_t data[STUB_EVENT_SIZE];
+};
+
+struct _jack_port {
+  char name[64];
+  jack_nframes_t nframes; /**< cycle length, set by jack_port_get_buffer() */
+  uint32_t n_events;
+  struct stub_event ev[STUB_MAX_EVENTS];
+};
+
+static struct _jack_port       stub_ports[MAX_OUTPUTS];
+static int                     stub_n_ports = 0;
+static jack_transport_state_t  stub_xstate = JackTransportStopped;
+static jack_position_t         stub_xpos;
+static uint64_t                stub_rejected = 0; /**< events out of order or outside the cycle */
+static uint64_t                stub_failed = 0;   /**< messages the generator could not queue */
+static uint64_t                stub_stale = 0;    /**< rolling cycles with an outdated song position */
+
+jack_transport_state_t jack_transport_query (const jack_client_t *client, jack_position_t *pos) {
+  if (pos) {
+    memcpy(pos, &stub_xpos, sizeof(jack_position_t));
+  }
+  return stub_xstate;
+}
+
+jack_port_t *jack_port_register (jack_client_t *client, const char *port_name, const char *port_type, unsigned long flags, unsigned long buffer_size) {
+  jack_port_t *p;
+  if (stub_n_ports >= MAX_OUTPUTS) return NULL;
+  p = &stub_ports[stub_n_ports++];
+  snprintf(p->name, sizeof(p->name), "bench:%s", port_name);
+  return p;
+}
+
+void *jack_port_get_buffer (jack_port_t *port, jack_nframes_t nframes) {
+  port->nframes = nframes;
+  return port;
+}
+const char *jack_port_name (const jack_port_t *port) { return port->name; }
+
+void jack_midi_clear_buffer (void *port_buffer) {
+  ((jack_port_t *)port_buffer)->n_events = 0;
+}
+
+uint32_t jack_midi_get_event_count (void *port_buffer) { return 0; }
+int jack_midi_event_get (jack_midi_event_t *event, void *port_buffer, uint32_t event_index) { return ENODATA; }
+
+/* like JACK: events must be reserved in time order, within the cycle */
+jack_midi_data_t *jack_midi_event_reserve (void *port_buffer, jack_nframes_t time, size_t data_size) {
+  jack_port_t *p = (jack_port_t *)port_buffer;
+  if (time >= p->nframes || (p->n_events > 0 && time < p->ev[p->n_events - 1].time)) {
+    stub_rejected++;
+    return NULL;
+  }
+  if (p->n_events >= STUB_MAX_EVENTS || data_size > STUB_EVENT_SIZE) return NULL;
+  p->ev[p->n_events].time = time;
+  p->ev[p->n_events].size = data_size;
+  return p->ev[p->n_events++].data;
+}
+
+void jack_port_get_latency_range (jack_port_t *port, jack_latency_callback_mode_t mode, jack_latency_range_t *range) {
+  range->min = range->max = 0;
+}
+
+jack_client_t *jack_client_open (const char *client_name, jack_options_t options, jack_status_t *status, ...) {
+  *status = JackFailure;
+  return NULL;
+}
+int   jack_client_close (jack_client_t *client) { return 0; }
+char *jack_get_client_name (jack_client_t *client) { return "bench"; }
+int   jack_set_process_callback (jack_client_t *client, JackProcessCallback cb, void *arg) { return 0; }
+int   jack_set_thread_init_callback (jack_client_t *client, JackThreadInitCallback cb, void *arg) { return 0; }
+void  jack_on_shutdown (jack_client_t *client, JackShutdownCallback cb, void *arg) { }
+int   jack_set_latency_callback (jack_client_t *client, JackLatencyCallback cb, void *arg) { return 0; }
+int   jack_activate (jack_client_t *client) { return 0; }
+int   jack_connect (jack_client_t *client, const char *src, const char *dst) { return 0; }
+jack_time_t jack_get_time (void) { return 1; }
+jack_nframes_t jack_last_frame_time (const jack_client_t *client) { return 0; }
+jack_time_t jack_frames_to_time (const jack_client_t *client, jack_nframes_t frames) { return 0; }
+int jack_is_realtime (jack_client_t *client) { return 0; }
+int jack_client_real_time_priority (jack_client_t *client) { return 0; }
+int jack_client_create_thread (jack_client_t *client, jack_native_thread_t *thread, int priority, int realtime, void *(*start_routine)(void *), void *arg) { return -1; }
+
+jack_ringbuffer_t *jack_ringbuffer_create (size_t sz) { return NULL; }
+void   jack_ringbuffer_free (jack_ringbuffer_t *rb) { }
+size_t jack_ringbuffer_read (jack_ringbuffer_t *rb, char *dest, size_t cnt) { return 0; }
+size_t jack_ringbuffer_write (jack_ringbuffer_t *rb, const char *src, size_t cnt) { return 0; }
+size_t jack_ringbuffer_read_space (const jack_ringbuffer_t *rb) { return 0; }
+size_t jack_ringbuffer_write_space (const jack_ringbuffer_t *rb) { return 0; }
+size_t jack_ringbuffer_peek (jack_ringbuffer_t *rb, char *dest, size_t cnt) { return 0; }
+void   jack_ringbuffer_read_advance (jack_ringbuffer_t *rb, size_t cnt) { }
+int    jack_ringbuffer_mlock (jack_ringbuffer_t *rb) { return 0; }
+
+/*****************************************************************************
+ * scenarios
+ */
+
+typedef struct {
+  const char    *name;
+  jack_nframes_t nframes;      /**< period size */
+  double         bpm_start;
+  double         bpm_end;      /**< linear tempo ramp over the whole run */
+  int            locate_every; /**< locate (Starting -> Rolling) every N cycles, 0: never */
+  const char    *outputs[4];   /**< output specs (see -o), NULL: default 'mclk_out' */
+} scenario;
+
+static const scenario scenarios[] = {
+  { "steady",      256, 120, 120,   0, { NULL } },
+  { "tiny-period",  16, 120, 120,   0, { NULL } },
+  { "huge-period",4096, 120, 120,   0, { NULL } },
+  { "fast-tempo",  256, 999, 999,   0, { NULL } },
+  { "tempo-ramp",  256,  40, 300,   0, { NULL } },
+  { "locate",      256, 120, 120,  50, { NULL } },
+  { "fan-out",     256, 120, 120,   0, { "a", "b,offset=64", "c,offset=-64,divider=2", "d,no-position" } },
+  { "mtc",         256, 120, 120,  50, { "a,mtc=25", "b,mtc=29.97,offset=64" } },
+};
+
+static int cmp_u32 (const void *a, const void *b) {
+  const uint32_t x = *(const uint32_t *)a;
+  const uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * reset generator state and configure outputs for a scenario
+ */
+static void setup (const scenario *sc) {
+  char spec[64];
+  int i;
+  stub_n_ports = 0;
+  n_outputs = 0;
+  for (i = 0; i < 4 && sc->outputs[i]; ++i) {
+    snprintf(spec, sizeof(spec), "%s", sc->outputs[i]);
+    parse_output(strdup(spec));
+  }
+  jack_portsetup();
+
+  memset(&last_xpos, 0, sizeof(struct bbtpos));
+  m_xstate = JackTransportStopped;
+  memset(&mclk_phase, 0, sizeof(tickphase));
+  memset(&mclk_sched, 0, sizeof(tickschedule));
+  memset(&rt_stats, 0, sizeof(struct mclk_stats));
+  prev_interval = 0;
+  next_cycle_start = 0;
+  next_mtc_start = -1;
+
+  memset(&stub_xpos, 0, sizeof(jack_position_t));
+  stub_xpos.frame_rate = 48000;
+  stub_xpos.valid = JackPositionBBT;
+  stub_xpos.beats_per_bar = 4;
+  stub_xpos.beat_type = 4;
+  stub_xpos.ticks_per_beat = 1920;
+  stub_xstate = JackTransportRolling;
+}
+
+/**
+ * fake timecode master: update BBT from frame and tempo
+ */
+static void update_bbt (double bpm) {
+  const double beats = stub_xpos.frame * bpm / (60.0 * stub_xpos.frame_rate);
+  const int64_t ibeats = beats;
+  stub_xpos.beats_per_minute = bpm;
+  stub_xpos.bar  = 1 + ibeats / 4;
+  stub_xpos.beat = 1 + ibeats % 4;
+  stub_xpos.tick = (beats - ibeats) * stub_xpos.ticks_per_beat;
+  stub_xpos.bar_start_tick = (stub_xpos.bar - 1) * 4 * stub_xpos.ticks_per_beat;
+}
+
+/**
+ * fake transport locate, JACK changes unique_1/unique_2 only here
+ */
+static void locate (jack_nframes_t frame) {
+  stub_xstate = JackTransportStarting;
+  stub_xpos.frame = frame;
+  stub_xpos.unique_1 = stub_xpos.unique_2 = stub_xpos.unique_1 + 1;
+}
+
+/**
+ * run a scenario
+ * @return 99th percentile [ns/cycle]
+ */
+static uint32_t run (const scenario *sc, uint32_t cycles, uint32_t *t) {
+  struct timespec t0, t1;
+  uint64_t events = 0;
+  uint64_t stale = 0;
+  uint32_t c;
+  int i;
+
+  setup(sc);
+
+  for (c = 0; c < cycles; ++c) {
+    update_bbt(sc->bpm_start + (sc->bpm_end - sc->bpm_start) * c / (double) cycles);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    process(sc->nframes, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t[c] = (t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
+
+    /* the cached song position must follow the rolling transport */
+    if (stub_xstate == JackTransportRolling
+	&& calc_song_pos(0) != mclk_song_pos(stub_xpos.bar, stub_xpos.beat, stub_xpos.tick, stub_xpos.beats_per_bar, stub_xpos.ticks_per_beat)) {
+      ++stale;
+    }
+
+    for (i = 0; i < stub_n_ports; ++i) {
+      events += stub_ports[i].n_events;
+    }
+
+    /* advance transport */
+    if (stub_xstate == JackTransportStarting) {
+      stub_xstate = JackTransportRolling;
+    } else if (sc->locate_every > 0 && (c % sc->locate_every) == sc->locate_every - 1) {
+      locate((stub_xpos.frame + 48000 * 7) % (1 << 30));
+    } else {
+      stub_xpos.frame += sc->nframes;
+      if (stub_xpos.frame > (1u << 31)) {
+	locate(0);
+      }
+    }
+  }
+
+  if (rt_stats.failed > 0) {
+    fprintf(stderr, "%s: %u messages could not be queued.\n", sc->name, rt_stats.failed);
+    stub_failed += rt_stats.failed;
+  }
+  if (stale > 0) {
+    fprintf(stderr, "%s: song position outdated in %llu rolling cycles.\n", sc->name, (unsigned long long) stale);
+    stub_stale += stale;
+  }
+
+  qsort(t, cycles, sizeof(uint32_t), cmp_u32);
+  printf("%-12s %5u %9u %10.2f %7u %7u %7u %7u %8u\n",
+      sc->name, sc->nframes, cycles, events / (double) cycles,
+      t[cycles / 2], t[(uint64_t) cycles * 99 / 100], t[(uint64_t) cycles * 999 / 1000],
+      t[cycles - 1], t[0]);
+  return t[(uint64_t) cycles * 99 / 100];
+}
+
+static void bench_usage (int status) {
+  printf ("jack_mclk_bench - benchmark jack_midi_clock's process callback.\n\n");
+  printf ("Usage: jack_mclk_bench [ OPTIONS ]\n\n");
+  printf ("Options:\n"
+"  -c <num>     process cycles per scenario (default: 1000000)\n"
+"  -g <ns>      fail if the 99th percentile of any scenario exceeds <ns>\n"
+"  -h           display this help and exit\n"
+"\n");
+  exit (status);
+}
+
+int main (int argc, char **argv) {
+  uint32_t cycles = 1000000;
+  uint32_t gate = 0;
+  uint32_t worst = 0;
+  uint32_t *t;
+  size_t i;
+  int c;
+
+  while ((c = getopt (argc, argv, "c:g:h")) != EOF) {
+    switch (c) {
+      case 'c':
+	cycles = atoi(optarg);
+	break;
+      case 'g':
+	gate = atoi(optarg);
+	break;
+      case 'h':
+	bench_usage (0);
+      default:
+	bench_usage (EXIT_FAILURE);
+    }
+  }
+  if (cycles < 1000) {
+    cycles = 1000;
+  }
+
+  if (!(t = malloc(cycles * sizeof(uint32_t)))) {
+    fprintf(stderr, "out of memory.\n");
+    return 1;
+  }
+
+  client_state = Run;
+
+  printf("%-12s %5s %9s %10s %7s %7s %7s %7s %8s\n",
+      "scenario", "nfrm", "cycles", "ev/cycle", "p50", "p99", "p99.9", "max", "min [ns]");
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenario); ++i) {
+    const uint32_t p99 = run(&scenarios[i], cycles, t);
+    if (p99 > worst) worst = p99;
+  }
+  free(t);
+
+  if (stub_rejected > 0 || stub_failed > 0 || stub_stale > 0) {
+    fprintf(stderr, "FAIL: %llu events out of order or outside the cycle, %llu not queued, %llu cycles with outdated song position\n",
+	(unsigned long long) stub_rejected, (unsigned long long) stub_failed, (unsigned long long) stub_stale);
+    return 1;
+  }
+  if (gate > 0 && worst > gate) {
+    fprintf(stderr, "FAIL: 99th percentile %u ns > %u ns\n", worst, gate);
+    return 1;
+  }
+  return 0;
+}
+
+/* vi:set ts=8 sts=2 sw=2: */
@@ -33,33 +33,91 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 #ifndef WIN32
 #include <signal.h>
 #include <pthread.h>
 #endif
+#include <semaphore.h>
 
 #include <jack/jack.h>
 #include <jack/transport.h>
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 
-#define RBSIZE 20
+#include "mclk_core.h"
+#include "mclk_mem.h"
+#include "mclk_shm.h"
+#include "mclk_net.h"
+
 #define METRUM (4) // TODO allow to configure.
+#define MAX_INPUTS 16
 
 typedef struct {
   uint8_t msg;
+  uint8_t port; ///< input port index
   int pos;
-  unsigned long long int tme;
+  unsigned long long int tme;  ///< time of the event [samples], see time_source
+  unsigned long long int usec; ///< time of the event, jack_frames_to_time() [usec], 0: unknown
 } timenfo;
 
+/* timebase of timenfo.tme */
+enum TimeSource {
+  TS_COUNTER = 0, ///< samples counted since activation: sum of the process cycles' nframes
+  TS_FRAMES,      ///< JACK frame time, jack_last_frame_time() + event offset
+  TS_USEC         ///< JACK frame time, also converted to microseconds with jack_frames_to_time()
+};
+
+/* clock info of a 0xf8 event, for printing */
+typedef struct {
+  int valid;      ///< previous clock is known
+  double bpm;     ///< current BPM
+  double flt_bpm; ///< DLL filtered BPM
+  long long dt;   ///< time since previous clock [samples]
+  int bp;         ///< current song position in MIDI beats, -1 if transport is stopped
+  int err_valid;  ///< DLL prediction is known
+  double err;     ///< deviation from the time predicted by the DLL [samples]
+} clkinfo;
+
+/* statistics of the deviation of clock ticks from the DLL prediction.
+ * The histogram has 4 log-spaced buckets per octave, bucket b > 0
+ * counts deviations up to 2^(b/4) usec, bucket 0 those below 1 usec.
+ */
+#define HIST_BUCKETS (2 + 4 * 24)
+
+typedef struct {
+  uint64_t n;       ///< number of ticks
+  double mean;      ///< mean deviation [usec]
+  double m2;        ///< sum of squared differences from the mean
+  double max;       ///< max absolute deviation [usec]
+  uint64_t hist[HIST_BUCKETS]; ///< histogram of absolute deviation
+} tickstats;
+
+/* network packet, as queued by the receive thread */
+typedef struct {
+  struct mclk_net_packet pk;
+  jack_time_t arrival; ///< jack_get_time() when the packet was received [usec]
+} netevent;
+
+/* message to re-emit on the output port in network receive mode */
 typedef struct {
-  double t0; ///< time of the current Mclk tick
-  double t1; ///< expected next Mclk tick
-  double e2; ///< second order loop error
-  double b, c, omega; ///< DLL filter coefficients
-} DelayLockedLoop;
+  jack_time_t time; ///< due time, jack_get_time() [usec]
+  uint8_t msg;
+  uint16_t pos;     ///< song position, for 0xf2
+} emitevent;
+
+#define NET_MAX_FILL 96 ///< max number of lost clock ticks to fill in
+
+/* preallocated output buffer for batch mode */
+typedef struct {
+  char buf[65536];
+  size_t len;
+} outbuf;
 
 struct appstate {
   timenfo pt; // previous timeinfo
@@ -67,38 +125,80 @@ struct appstate {
   uint64_t transport; /// timestamp of transport start/continue, 0 if stopped
   uint64_t sequence; /// beat clock signals since transport-state change
   int bcnt;  /// last song position
+  tickstats period; /// statistics since last summary
+  tickstats total;  /// statistics since start
+  unsigned long long next_report; /// time of next summary [samples], 0: unset
+  clkinfo clk;      /// last clock tick, for export
+  uint64_t ticks;   /// clock ticks received
+  double max_err;   /// max absolute deviation from the DLL prediction [samples]
 };
 
 /* jack connection */
 jack_client_t *j_client = NULL;
-jack_port_t   *mclk_input_port;
+jack_port_t   *mclk_input_port[MAX_INPUTS];
+static int     n_inputs = 1;
 
 /* threaded communication */
 static jack_ringbuffer_t *rb = NULL;
-static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+static sem_t data_ready;
+static int wakeup_pending = 0;                  ///< data was queued, but reader was not woken
+static unsigned long long last_wakeup = 0;      ///< time of last wakeup [samples]
+static unsigned long long wakeup_interval = 0;  ///< min time between wakeups [samples]
+/* events dropped due to a full ringbuffer, one counter per writing thread */
+static volatile uint32_t overflows = 0;         ///< process(): rb
+static volatile uint32_t net_overflows = 0;     ///< net_thread(): net_rb
+static volatile uint32_t emit_overflows = 0;    ///< main thread, emit_event(): emit_rb
+
+/* network receive mode */
+static jack_port_t *mclk_output_port = NULL;   ///< re-emitted clock
+static jack_ringbuffer_t *net_rb = NULL;        ///< packets, receive thread -> main
+static jack_ringbuffer_t *emit_rb = NULL;       ///< messages to re-emit, main -> process
+static int net_sock = -1;
+static int net_thread_running = 0;
+static pthread_t net_thread_id;
+static uint32_t net_lost = 0;                   ///< packets lost, gaps in the sequence
 
 /* application state */
 static double samplerate = 48000.0;
 static volatile unsigned long long monotonic_cnt = 0;
+static unsigned long long frame_time = 0; ///< jack_last_frame_time() of the current cycle, without wrap-around
 static int run = 1;
 
 /* options */
 static char newline = '\r'; // or '\n';
 static short keeplastclk = 1;  // print newline on events
+static short batch_output = 0; // format events into a buffer and write() it once per wakeup
+static short quiet = 0;        // do not print events
+static double max_wakeup_rate = 0; // Hz, 0: wake up reader every cycle with new data
+static double max_bpm = 300.0;  // used to size the ringbuffer
+static int ppqn = MCLK_PPQN;    // clock ticks per quarter note
+static int queue_size = 0;      // ringbuffer size in events, 0: auto
+static const char *record_path = NULL; // binary capture file
+static const char *replay_path = NULL; // analyze binary capture instead of using JACK
 static double dll_bandwidth = 6.0; // 1/Hz
+static int dll_order = 2;          // 2nd or 3rd order DLL
+static short dll_adaptive = 0;     // adapt DLL bandwidth
+static double stats_interval = 0;  // seconds between summaries, 0: print every tick
+static const char *shm_name = NULL; // export state in POSIX shared memory
+static struct mclk_shm_dump *shm = NULL;
+static const char *net_spec = NULL; // receive clock from the network instead of a JACK port
+static double net_delay = 20.0;     // delay of the re-emitted clock [ms]
+static int time_source = TS_COUNTER; // timebase of event timestamps
+static short lock_all = 1;           // mlockall() in addition to locking the realtime data
 
-static struct appstate state;
+static struct appstate state[MAX_INPUTS];
+static outbuf output;
 static void print_time_event(struct appstate *s, timenfo *t);
 
 /**
  * parse Midi Beat Clock events
- * enqueue to ring buffer and wake-up 'dump' thread
+ * enqueue to ring buffer
+ * @return 1 if an event was queued, 0 otherwise
  */
-static void process_jmidi_event(jack_midi_event_t *ev, unsigned long long mfcnt) {
+static int process_jmidi_event(jack_midi_event_t *ev, int port, unsigned long long mfcnt) {
   timenfo tnfo;
   memset(&tnfo, 0, sizeof(timenfo));
-  if (ev->size != 1 && !((ev->size == 3 && ev->buffer[0] == 0xf2 ))) return;
+  if (ev->size != 1 && !((ev->size == 3 && ev->buffer[0] == 0xf2 ))) return 0;
 
   switch(ev->buffer[0]) {
     case 0xf2: // position
@@ -110,38 +210,117 @@ static void process_jmidi_event(jack_midi_event_t *ev, unsigned long long mfcnt)
     case 0xfc: // stop
       break;
     default:
-      return;
+      return 0;
   }
 
   tnfo.msg = ev->buffer[0];
+  tnfo.port = port;
   tnfo.tme = mfcnt + ev->time;
+  if (time_source == TS_USEC) {
+    tnfo.usec = jack_frames_to_time(j_client, (jack_nframes_t) tnfo.tme);
+  }
 #ifdef JACK_TRANSPORT_SYNC_CHECK
-  print_time_event(&state, &tnfo);
+  print_time_event(&state[port], &tnfo);
 #else
   if (jack_ringbuffer_write_space(rb) >= sizeof(timenfo)) {
     jack_ringbuffer_write(rb, (void *) &tnfo, sizeof(timenfo));
+    return 1;
   }
+  overflows++;
+#endif
+  return 0;
+}
+
+/**
+ * write messages that are due in this cycle to the output port,
+ * they are played one period later, like all JACK MIDI output.
+ */
+static void emit_cycle(jack_nframes_t nframes) {
+  void *buf = jack_port_get_buffer(mclk_output_port, nframes);
+  const jack_nframes_t base = jack_last_frame_time(j_client) + nframes;
+  emitevent e;
 
-  if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
-    pthread_cond_signal (&data_ready);
-    pthread_mutex_unlock (&msg_thread_lock);
+  jack_midi_clear_buffer(buf);
+  while (jack_ringbuffer_read_space(emit_rb) >= sizeof(emitevent)) {
+    jack_midi_data_t *d;
+    int32_t off;
+    jack_ringbuffer_peek(emit_rb, (char *) &e, sizeof(emitevent));
+    off = jack_time_to_frames(j_client, e.time) - base;
+    if (off >= (int32_t) nframes) {
+      break;
+    }
+    if (off < 0) {
+      off = 0;
+    }
+    if ((d = jack_midi_event_reserve(buf, off, e.msg == 0xf2 ? 3 : 1))) {
+      d[0] = e.msg;
+      if (e.msg == 0xf2) {
+	d[1] = e.pos & 0x7f;
+	d[2] = (e.pos >> 7) & 0x7f;
+      }
+    }
+    jack_ringbuffer_read_advance(emit_rb, sizeof(emitevent));
   }
-#endif
 }
 
 /**
  * jack process callback
+ * events of all input ports are merged in chronological order.
+ * The 'dump' thread is woken up at most once per cycle, and only
+ * if new data was queued.
  */
 static int process(jack_nframes_t nframes, void *arg) {
-  void *jack_buf = jack_port_get_buffer(mclk_input_port, nframes);
-  int nevents = jack_midi_get_event_count(jack_buf);
-  int n;
+  void *jack_buf[MAX_INPUTS];
+  int nevents[MAX_INPUTS];
+  int next[MAX_INPUTS];
+  jack_midi_event_t ev[MAX_INPUTS];
+  int i;
+
+  if (mclk_output_port) {
+    /* network receive mode */
+    emit_cycle(nframes);
+    return 0;
+  }
+
+  if (time_source != TS_COUNTER) {
+    /* extend the 32 bit frame time, it wraps after a day at 48kHz */
+    frame_time += (jack_nframes_t) (jack_last_frame_time(j_client) - (jack_nframes_t) frame_time);
+  }
 
-  for (n=0; n < nevents; n++) {
-    jack_midi_event_t ev;
-    jack_midi_event_get(&ev, jack_buf, n);
-    process_jmidi_event(&ev, monotonic_cnt);
+  for (i = 0; i < n_inputs; ++i) {
+    jack_buf[i] = jack_port_get_buffer(mclk_input_port[i], nframes);
+    nevents[i] = jack_midi_get_event_count(jack_buf[i]);
+    next[i] = 0;
+    if (nevents[i] > 0) {
+      jack_midi_event_get(&ev[i], jack_buf[i], 0);
+    }
   }
+
+  while (1) {
+    int port = -1;
+    for (i = 0; i < n_inputs; ++i) {
+      if (next[i] < nevents[i] && (port < 0 || ev[i].time < ev[port].time)) {
+	port = i;
+      }
+    }
+    if (port < 0) {
+      break;
+    }
+    if (process_jmidi_event(&ev[port], port, time_source == TS_COUNTER ? monotonic_cnt : frame_time)) {
+      wakeup_pending = 1;
+    }
+    if (++next[port] < nevents[port]) {
+      jack_midi_event_get(&ev[port], jack_buf[port], next[port]);
+    }
+  }
+
+  /* wake up 'dump' thread, rate-limited */
+  if (wakeup_pending && monotonic_cnt - last_wakeup >= wakeup_interval) {
+    sem_post (&data_ready);
+    last_wakeup = monotonic_cnt;
+    wakeup_pending = 0;
+  }
+
   monotonic_cnt += nframes;
   return 0;
 }
@@ -151,7 +330,7 @@ static int process(jack_nframes_t nframes, void *arg) {
  */
 void jack_shutdown(void *arg) {
   j_client=NULL;
-  pthread_cond_signal (&data_ready);
+  sem_post (&data_ready);
   fprintf (stderr, "jack server shutdown\n");
 }
 
@@ -164,12 +343,38 @@ void cleanup(void) {
     jack_deactivate (j_client);
     jack_client_close (j_client);
   }
+  if (net_thread_running) {
+    run = 0;
+    pthread_join(net_thread_id, NULL);
+    net_thread_running = 0;
+  }
+  if (net_sock >= 0) {
+    close(net_sock);
+    net_sock = -1;
+  }
   if (rb) {
     jack_ringbuffer_free(rb);
   }
+  if (net_rb) {
+    jack_ringbuffer_free(net_rb);
+  }
+  if (emit_rb) {
+    jack_ringbuffer_free(emit_rb);
+  }
+  if (shm) {
+    mclk_shm_destroy(shm_name, shm);
+    shm = NULL;
+  }
   j_client = NULL;
 }
 
+/**
+ * called by JACK in the process thread before the first cycle
+ */
+static void rt_thread_init(void *arg) {
+  mclk_mem_lock_stack();
+}
+
 /**
  * open a client connection to the JACK server
  */
@@ -191,6 +396,7 @@ static int init_jack(const char *client_name) {
     fprintf (stderr, "jack-client name: `%s'\n", client_name);
   }
   jack_set_process_callback (j_client, process, 0);
+  jack_set_thread_init_callback (j_client, rt_thread_init, NULL);
 
 #ifndef WIN32
   jack_on_shutdown (j_client, jack_shutdown, NULL);
@@ -201,44 +407,93 @@ static int init_jack(const char *client_name) {
 }
 
 static int jack_portsetup(void) {
-  if ((mclk_input_port = jack_port_register(j_client, "mclk_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
-    fprintf (stderr, "cannot register mclk input port !\n");
-    return (-1);
+  int i;
+  if (net_spec) {
+    if ((mclk_output_port = jack_port_register(j_client, "mclk_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk output port !\n");
+      return (-1);
+    }
+    return (0);
+  }
+  for (i = 0; i < n_inputs; ++i) {
+    char name[32];
+    if (n_inputs > 1) {
+      snprintf(name, sizeof(name), "mclk_in_%d", i + 1);
+    } else {
+      strcpy(name, "mclk_in");
+    }
+    if ((mclk_input_port[i] = jack_port_register(j_client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk input port !\n");
+      return (-1);
+    }
   }
   return (0);
 }
 
-static void port_connect(char *mclk_port) {
-  if (mclk_port && jack_connect(j_client, mclk_port, jack_port_name(mclk_input_port))) {
-    fprintf(stderr, "cannot connect port %s to %s\n", mclk_port, jack_port_name(mclk_input_port));
+/**
+ * lock the data that is used in realtime context, and prefault it:
+ * ring buffers, ports and per-port state and statistics.
+ * The stack of the process thread is locked by rt_thread_init().
+ * @return 0 on success, -1 if some memory could not be locked
+ */
+static int rt_lock(void) {
+  int rv = 0;
+  rv |= jack_ringbuffer_mlock(rb);
+  if (net_rb)  rv |= jack_ringbuffer_mlock(net_rb);
+  if (emit_rb) rv |= jack_ringbuffer_mlock(emit_rb);
+  rv |= mclk_mem_lock(mclk_input_port, sizeof(mclk_input_port));
+  rv |= mclk_mem_lock(state, sizeof(state));
+  if (lock_all && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    rv = -1;
+  }
+  return rv ? -1 : 0;
+}
+
+static void port_connect(int port, char *mclk_port) {
+  if (mclk_output_port) {
+    if (mclk_port && jack_connect(j_client, jack_port_name(mclk_output_port), mclk_port)) {
+      fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(mclk_output_port), mclk_port);
+    }
+    return;
+  }
+  if (mclk_port && jack_connect(j_client, mclk_port, jack_port_name(mclk_input_port[port]))) {
+    fprintf(stderr, "cannot connect port %s to %s\n", mclk_port, jack_port_name(mclk_input_port[port]));
   }
 }
 
 /**
- * initialize DLL
- * set current time and period in samples
+ * number of events the ringbuffer needs to hold:
+ * clock ticks (at max_bpm) of all inputs for one second, plus
+ * one period and the wakeup interval, plus some transport messages.
  */
-static void init_dll(DelayLockedLoop *dll, double tme, double period) {
-  const double omega = 2.0 * M_PI * period / dll_bandwidth / samplerate;
-  dll->b = 1.4142135623730950488 * omega;
-  dll->c = omega * omega;
+static int auto_queue_size(void) {
+  const double ticks_per_sec = max_bpm * ppqn / 60.0;
+  const double hold = 1.0 + (jack_get_buffer_size (j_client) + wakeup_interval) / samplerate;
+  return n_inputs * ((int) ceil(ticks_per_sec * hold) + 8);
+}
 
-  dll->e2 = period / samplerate;
-  dll->t0 = tme / samplerate;
-  dll->t1 = dll->t0 + dll->e2;
+/**
+ * events dropped by all threads
+ */
+static uint32_t total_overflows(void) {
+  return overflows + net_overflows + emit_overflows;
 }
 
 /**
- * run one loop iteration.
- * @param tme time of event (in samples)
- * @return smoothed interval (period) [1/Hz]
+ * report events dropped since last call
  */
-static double run_dll(DelayLockedLoop *dll, double tme) {
-  const double e = tme / samplerate - dll->t1;
-  dll->t0 = dll->t1;
-  dll->t1 += dll->b * e + dll->e2;
-  dll->e2 += dll->c * e;
-  return (dll->t1 - dll->t0);
+static void report_overflows(void) {
+  static uint32_t reported = 0;
+  static uint32_t reported_lost = 0;
+  const uint32_t cnt = total_overflows();
+  if (cnt != reported) {
+    fprintf(stderr, "WARNING: %u events dropped, ringbuffer overflow (%u total).\n", cnt - reported, cnt);
+    reported = cnt;
+  }
+  if (net_lost != reported_lost) {
+    fprintf(stderr, "WARNING: %u network packets lost (%u total).\n", net_lost - reported_lost, net_lost);
+    reported_lost = net_lost;
+  }
 }
 
 const char *msg_to_string(uint8_t msg) {
@@ -251,6 +506,13 @@ const char *msg_to_string(uint8_t msg) {
   }
 }
 
+/**
+ * timestamp to print: microseconds if requested and known, else samples
+ */
+static unsigned long long event_time(const timenfo *t) {
+  return (time_source == TS_USEC && t->usec) ? t->usec : t->tme;
+}
+
 #ifdef JACK_TRANSPORT_SYNC_CHECK
 static const char *jt_to_string(jack_transport_state_t jts) {
   switch(jts) {
@@ -273,90 +535,721 @@ static void print_jt(jack_transport_state_t jts, jack_position_t *jtpos) {
 }
 #endif
 
+/**
+ * update application state with a received event.
+ * @param s application state
+ * @param t received event
+ * @param ci filled with clock info to print for 0xf8 events
+ */
+static void update_state(struct appstate *s, timenfo *t, clkinfo *ci) {
+  memset(ci, 0, sizeof(clkinfo));
+  ci->bp = -1;
+
+  if (t->msg == 0xf2) {
+    /* song position */
+    s->bcnt = t->pos;
+  }
+  else if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
+    /* start, stop, continue -> reset */
+    s->sequence = 0;
+    if (t->msg == 0xfc) s->transport = 0; // stop
+    else s->transport = t->tme;
+    if (t->msg == 0xfa) s->bcnt = 0; // start
+  }
+  else if (s->sequence == 1) {
+    /* 2nd event in sequence -> initialize DLL with time difference */
+    init_dll_ext(&s->dll, t->tme, (t->tme - s->pt.tme), samplerate, dll_bandwidth, dll_order, dll_adaptive);
+    ci->flt_bpm = mclk_bpm(samplerate, t->tme - s->pt.tme, ppqn);
+  }
+  else if (s->sequence > 1) {
+    /* deviation from prediction, run dll, calculate filtered bpm */
+    ci->err = t->tme - s->dll.t1 * samplerate;
+    ci->err_valid = 1;
+    ci->flt_bpm = mclk_bpm(1.0, run_dll(&s->dll, t->tme, samplerate), ppqn);
+  }
+
+  if (t->msg != 0xf8) {
+    return;
+  }
+
+  if (s->sequence > 0) {
+    ci->valid = 1;
+    ci->dt = t->tme - s->pt.tme;
+    ci->bpm = mclk_bpm(samplerate, ci->dt, ppqn);
+    if (s->transport) {
+      ci->bp = s->bcnt + s->sequence * SPP_PER_QN / ppqn;
+    }
+  }
+
+  memcpy(&s->pt, t, sizeof(timenfo));
+  s->sequence++;
+
+  memcpy(&s->clk, ci, sizeof(clkinfo));
+  s->ticks++;
+  if (ci->err_valid && fabs(ci->err) > s->max_err) {
+    s->max_err = fabs(ci->err);
+  }
+}
+
 static void print_time_event(struct appstate *s, timenfo *t) {
-  double flt_bpm = 0;
+  clkinfo ci;
 #ifdef JACK_TRANSPORT_SYNC_CHECK
     jack_position_t jtpos;
     jack_transport_state_t jts = jack_transport_query(j_client, &jtpos);
 #endif
 
-  if (t->msg == 0xf2) {
-    /* song position */
-    s->bcnt = t->pos;
+  update_state(s, t, &ci);
+
+  if (n_inputs > 1) {
+    printf("[%d] ", t->port + 1);
+  }
 
+  if (t->msg == 0xf2) {
     if (newline == '\r' && keeplastclk) printf("\n");
+    int bar, beat, sub;
+    mclk_song_pos_bbt(t->pos, METRUM, &bar, &beat, &sub);
     fprintf(stdout, "POS (0x%04x) %4d.%d[beats] %4d|%d|%d [BBT@4/4] %-16s",
 	t->pos,
-	1 + t->pos/4, t->pos%4,
-	1 + (t->pos/4/METRUM), 1 + ((t->pos/4)%METRUM), t->pos%4,
+	1 + t->pos/SPP_PER_QN, t->pos%SPP_PER_QN,
+	bar, beat, sub,
 	"");
 #ifdef JACK_TRANSPORT_SYNC_CHECK
       printf("           ");
 #endif
-    fprintf(stdout, " @ %lld       \n", t->tme);
+    fprintf(stdout, " @ %lld       \n", event_time(t));
   }
   else if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
-    /* start, stop, continue -> reset */
-    s->sequence = 0;
-    if (t->msg == 0xfc) s->transport = 0; // stop
-    else s->transport = t->tme;
-    if (t->msg == 0xfa) s->bcnt = 0; // start
-
     if (newline == '\r' && keeplastclk) printf("\n");
     fprintf(stdout, "EVENT (0x%02x) %-49s",
 	t->msg, msg_to_string(t->msg));
 #ifdef JACK_TRANSPORT_SYNC_CHECK
       printf("           ");
 #endif
-    fprintf(stdout, " @ %lld       \n", t->tme);
-  }
-  else if (s->sequence == 1) {
-    /* 2nd event in sequence -> initialize DLL with time difference */
-    init_dll(&s->dll, t->tme, (t->tme - s->pt.tme));
-    flt_bpm = samplerate * 60.0 / (24.0 * (double)(t->tme - s->pt.tme));
-  }
-  else if (s->sequence > 1) {
-    /* run dll, calculate filtered bpm */
-    flt_bpm = 60.0 / (24.0 * run_dll(&s->dll, t->tme));
+    fprintf(stdout, " @ %lld       \n", event_time(t));
   }
 
   /* print clock & bpm */
-  if (t->msg == 0xf8 && s->sequence > 0) {
-    const double samples_per_quarter_note = (t->tme - s->pt.tme) * 24.0;
-    const double bpm = samplerate * 60.0 / samples_per_quarter_note;
-    fprintf(stdout, "CLK cur: %7.2f[BPM] flt: %7.2f[BPM]  dt: %4lld[sm]", bpm, flt_bpm, (t->tme - s->pt.tme));
-    if (s->transport) {
-      int bp = s->bcnt + s->sequence / 6;
-      printf(" %4d|%d|%d", 1 + (bp/4/METRUM), 1 + ((bp/4)%METRUM), bp%4);
+  if (t->msg == 0xf8 && ci.valid) {
+    fprintf(stdout, "CLK cur: %7.2f[BPM] flt: %7.2f[BPM]  dt: %4lld[sm]", ci.bpm, ci.flt_bpm, ci.dt);
+    if (ci.bp >= 0) {
+      int bar, beat, sub;
+      mclk_song_pos_bbt(ci.bp, METRUM, &bar, &beat, &sub);
+      printf(" %4d|%d|%d", bar, beat, sub);
     } else {
       printf(" ----|-|-");
     }
 #ifdef JACK_TRANSPORT_SYNC_CHECK
     print_jt(jts, &jtpos);
 #endif
-    fprintf(stdout, " @ %lld       %c", t->tme, newline);
+    fprintf(stdout, " @ %lld       %c", event_time(t), newline);
   } else if (t->msg == 0xf8) {
     fprintf(stdout, "CLK cur:      ??[BPM] flt:      ??[BPM]  dt:   ??[sm]         ");
 #ifdef JACK_TRANSPORT_SYNC_CHECK
     print_jt(jts, &jtpos);
 #endif
-    fprintf(stdout, " @ %lld       %c", t->tme, newline);
+    fprintf(stdout, " @ %lld       %c", event_time(t), newline);
+  }
+}
+
+/* batched output.
+ * Format events into a preallocated buffer without stdio,
+ * the buffer is written with a single write() per batch.
+ */
+
+static void ob_flush(outbuf *ob) {
+  size_t off = 0;
+  while (off < ob->len) {
+    const ssize_t rv = write(STDOUT_FILENO, ob->buf + off, ob->len - off);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv <= 0) break;
+    off += rv;
+  }
+  ob->len = 0;
+}
+
+static void ob_char(outbuf *ob, char c) {
+  if (ob->len >= sizeof(ob->buf)) {
+    ob_flush(ob);
+  }
+  ob->buf[ob->len++] = c;
+}
+
+static void ob_pad(outbuf *ob, int n) {
+  while (n-- > 0) ob_char(ob, ' ');
+}
+
+/** append string, left aligned, padded to given width */
+static void ob_str(outbuf *ob, const char *str, int width) {
+  while (*str) {
+    ob_char(ob, *str++);
+    --width;
+  }
+  ob_pad(ob, width);
+}
+
+/** append unsigned integer in given base, right aligned or zero-padded */
+static void ob_uint(outbuf *ob, unsigned long long v, int width, int base, char padc) {
+  char tmp[24];
+  int n = 0;
+  do {
+    tmp[n++] = "0123456789abcdef"[v % base];
+    v /= base;
+  } while (v > 0);
+  while (width-- > n) ob_char(ob, padc);
+  while (n > 0) ob_char(ob, tmp[--n]);
+}
+
+/** append signed decimal integer, right aligned */
+static void ob_int(outbuf *ob, long long v, int width) {
+  if (v < 0) {
+    /* count digits for padding */
+    unsigned long long a = -(unsigned long long)v;
+    int n = 1;
+    while (a >= 10) { a /= 10; ++n; }
+    ob_pad(ob, width - n - 1);
+    ob_char(ob, '-');
+    ob_uint(ob, -(unsigned long long)v, 0, 10, ' ');
+  } else {
+    ob_uint(ob, v, width, 10, ' ');
+  }
+}
+
+/** append fixed-point number with 2 decimals, right aligned */
+static void ob_fix2(outbuf *ob, double v, int width) {
+  if (!isfinite(v) || fabs(v) > 1e15) {
+    const char *str = isnan(v) ? "nan" : (v < 0 ? "-inf" : "inf");
+    ob_pad(ob, width - strlen(str));
+    ob_str(ob, str, 0);
+    return;
+  }
+  const long long c = llrint(v * 100.0);
+  const unsigned long long a = c < 0 ? -(unsigned long long)c : c;
+  unsigned long long ip = a / 100;
+  int n = 4; // ".xx" + 1 digit
+  while (ip >= 10) { ip /= 10; ++n; }
+  if (c < 0) ++n;
+  ob_pad(ob, width - n);
+  if (c < 0) ob_char(ob, '-');
+  ob_uint(ob, a / 100, 0, 10, ' ');
+  ob_char(ob, '.');
+  ob_uint(ob, a % 100, 2, 10, '0');
+}
+
+static void ob_bbt(outbuf *ob, int bp) {
+  int bar, beat, sub;
+  mclk_song_pos_bbt(bp, METRUM, &bar, &beat, &sub);
+  ob_int(ob, bar, 4);
+  ob_char(ob, '|');
+  ob_int(ob, beat, 0);
+  ob_char(ob, '|');
+  ob_int(ob, sub, 0);
+}
+
+static void ob_time(outbuf *ob, timenfo *t, char nl) {
+  ob_str(ob, " @ ", 0);
+  ob_uint(ob, event_time(t), 0, 10, ' ');
+  ob_str(ob, "       ", 0);
+  ob_char(ob, nl);
+}
+
+/**
+ * format event into buffer, same output as print_time_event()
+ */
+static void format_time_event(struct appstate *s, timenfo *t, outbuf *ob) {
+  clkinfo ci;
+  update_state(s, t, &ci);
+
+  if (n_inputs > 1) {
+    ob_char(ob, '[');
+    ob_int(ob, t->port + 1, 0);
+    ob_str(ob, "] ", 0);
   }
 
-  if (t->msg == 0xf8) {
-    memcpy(&s->pt, t, sizeof(timenfo));
-    s->sequence++;
+  if (t->msg == 0xf2) {
+    if (newline == '\r' && keeplastclk) ob_char(ob, '\n');
+    ob_str(ob, "POS (0x", 0);
+    ob_uint(ob, t->pos, 4, 16, '0');
+    ob_str(ob, ") ", 0);
+    ob_int(ob, 1 + t->pos/SPP_PER_QN, 4);
+    ob_char(ob, '.');
+    ob_int(ob, t->pos%SPP_PER_QN, 0);
+    ob_str(ob, "[beats] ", 0);
+    ob_bbt(ob, t->pos);
+    ob_str(ob, " [BBT@4/4] ", 0);
+    ob_pad(ob, 16);
+    ob_time(ob, t, '\n');
+  }
+  else if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
+    if (newline == '\r' && keeplastclk) ob_char(ob, '\n');
+    ob_str(ob, "EVENT (0x", 0);
+    ob_uint(ob, t->msg, 2, 16, '0');
+    ob_str(ob, ") ", 0);
+    ob_str(ob, msg_to_string(t->msg), 49);
+    ob_time(ob, t, '\n');
+  }
+  else if (t->msg == 0xf8 && ci.valid) {
+    ob_str(ob, "CLK cur: ", 0);
+    ob_fix2(ob, ci.bpm, 7);
+    ob_str(ob, "[BPM] flt: ", 0);
+    ob_fix2(ob, ci.flt_bpm, 7);
+    ob_str(ob, "[BPM]  dt: ", 0);
+    ob_int(ob, ci.dt, 4);
+    ob_str(ob, "[sm] ", 0);
+    if (ci.bp >= 0) {
+      ob_bbt(ob, ci.bp);
+    } else {
+      ob_str(ob, "----|-|-", 0);
+    }
+    ob_time(ob, t, newline);
+  }
+  else if (t->msg == 0xf8) {
+    ob_str(ob, "CLK cur:      ??[BPM] flt:      ??[BPM]  dt:   ??[sm]         ", 0);
+    ob_time(ob, t, newline);
   }
 }
 
 
-/* TODO: it's not safe to call pthread_cond_signal from a signal handler
- * See http://pubs.opengroup.org/onlinepubs/009695399/functions/pthread_cond_broadcast.html
+/* binary capture format
+ *
+ * file:   "MCLK" <version:u8> <input ports:u8> <block>*
+ * block:  0xb1 <samplerate:varint> <base time:varint> <event count:varint> <event>*
+ * event:  <msg:u8> <port:u8> [<position:varint> if msg == 0xf2] <time delta:varint>
+ *
+ * All integers are unsigned LEB128 varints. Event times are delta
+ * encoded, the first event of a block relative to the block's base
+ * time. Every block can be decoded on its own.
  */
+#define CAPTURE_VERSION 2
+#define CAPTURE_BLOCK   0xb1
+
+typedef struct {
+  FILE *f;
+  unsigned long long base; ///< time of first event in block
+  unsigned long long last; ///< time of previous event in block
+  unsigned int count;      ///< events in block
+  size_t len;
+  uint8_t buf[4096];
+} capture;
+
+static capture rec;
+
+static size_t varint_put(uint8_t *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static const uint8_t *varint_get(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  int shift = 0;
+  *v = 0;
+  while (p < end && shift < 64) {
+    *v |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) return p;
+    shift += 7;
+  }
+  return NULL;
+}
+
+static int capture_open(capture *c, const char *path) {
+  const uint8_t hdr[6] = {'M', 'C', 'L', 'K', CAPTURE_VERSION, n_inputs};
+  memset(c, 0, sizeof(capture));
+  if (!(c->f = fopen(path, "wb"))) {
+    fprintf(stderr, "cannot open capture file '%s'.\n", path);
+    return -1;
+  }
+  fwrite(hdr, sizeof(hdr), 1, c->f);
+  return 0;
+}
+
+/**
+ * write pending events as block
+ */
+static void capture_flush(capture *c) {
+  uint8_t hdr[32];
+  size_t n = 0;
+  if (!c->f || c->count == 0) return;
+  hdr[n++] = CAPTURE_BLOCK;
+  n += varint_put(&hdr[n], (uint64_t) samplerate);
+  n += varint_put(&hdr[n], c->base);
+  n += varint_put(&hdr[n], c->count);
+  fwrite(hdr, n, 1, c->f);
+  fwrite(c->buf, c->len, 1, c->f);
+  fflush(c->f);
+  c->count = 0;
+  c->len = 0;
+}
+
+static void capture_event(capture *c, timenfo *t) {
+  if (!c->f) return;
+  if (c->len + 24 > sizeof(c->buf)) {
+    capture_flush(c);
+  }
+  if (c->count == 0) {
+    c->base = c->last = t->tme;
+  }
+  c->buf[c->len++] = t->msg;
+  c->buf[c->len++] = t->port;
+  if (t->msg == 0xf2) {
+    c->len += varint_put(&c->buf[c->len], t->pos);
+  }
+  c->len += varint_put(&c->buf[c->len], t->tme - c->last);
+  c->last = t->tme;
+  c->count++;
+}
+
+static void capture_close(capture *c) {
+  if (!c->f) return;
+  capture_flush(c);
+  fclose(c->f);
+  c->f = NULL;
+}
+
+/**
+ * add a deviation to statistics (Welford's algorithm)
+ * @param err deviation [usec]
+ */
+static void stats_add(tickstats *st, double err) {
+  const double a = fabs(err);
+  const double d = err - st->mean;
+  int b = 0;
+
+  st->n++;
+  st->mean += d / st->n;
+  st->m2 += d * (err - st->mean);
+  if (a > st->max) st->max = a;
+
+  if (a >= 1.0) {
+    b = 1 + (int) floor(4.0 * log2(a));
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+  }
+  st->hist[b]++;
+}
+
+/**
+ * upper bound of a histogram bucket [usec]
+ */
+static double stats_bucket_limit(int b) {
+  return pow(2.0, b / 4.0);
+}
+
+/**
+ * percentile from the histogram, upper bound of the bucket [usec]
+ */
+static double stats_percentile(const tickstats *st, double p) {
+  const uint64_t want = ceil(p * st->n);
+  uint64_t cnt = 0;
+  int b;
+  for (b = 0; b < HIST_BUCKETS - 1; ++b) {
+    cnt += st->hist[b];
+    if (cnt >= want) break;
+  }
+  return stats_bucket_limit(b) < st->max ? stats_bucket_limit(b) : st->max;
+}
+
+static void print_stats(const char *prefix, int port, const tickstats *st) {
+  printf("%s ", prefix);
+  if (n_inputs > 1) {
+    printf("[%d] ", port + 1);
+  }
+  if (st->n == 0) {
+    printf("ticks: 0\n");
+    return;
+  }
+  printf("ticks: %llu dev mean: %+.1f stddev: %.1f p50: %.1f p99: %.1f p99.9: %.1f max: %.1f [usec]\n",
+      (unsigned long long) st->n, st->mean,
+      st->n > 1 ? sqrt(st->m2 / (st->n - 1)) : 0,
+      stats_percentile(st, .5), stats_percentile(st, .99), stats_percentile(st, .999),
+      st->max);
+}
+
+/**
+ * print statistics since start, and histogram of all ports
+ */
+static void print_stats_total(void) {
+  int i, b;
+  if (stats_interval <= 0) {
+    return;
+  }
+  if (batch_output) {
+    ob_flush(&output);
+  }
+  for (i = 0; i < n_inputs; ++i) {
+    const tickstats *st = &state[i].total;
+    print_stats("TOTAL", i, st);
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+      if (st->hist[b] == 0) continue;
+      printf("HIST ");
+      if (n_inputs > 1) {
+	printf("[%d] ", i + 1);
+      }
+      printf("<= %9.1f [usec]: %10llu %6.2f%%\n", stats_bucket_limit(b),
+	  (unsigned long long) st->hist[b], 100.0 * st->hist[b] / st->n);
+    }
+  }
+  fflush(stdout);
+}
+
+/**
+ * collect statistics, print summary every stats_interval
+ */
+static void stats_event(struct appstate *s, timenfo *t, clkinfo *ci) {
+  if (ci->err_valid) {
+    const double err = 1e6 * ci->err / samplerate;
+    stats_add(&s->period, err);
+    stats_add(&s->total, err);
+  }
+  if (s->next_report == 0) {
+    s->next_report = t->tme + stats_interval * samplerate;
+  }
+  if (t->tme < s->next_report) {
+    return;
+  }
+  if (batch_output) {
+    ob_flush(&output);
+  }
+  print_stats("STAT", t->port, &s->period);
+  fflush(stdout);
+  memset(&s->period, 0, sizeof(tickstats));
+  s->next_report += stats_interval * samplerate;
+}
+
+/**
+ * record and/or print event
+ */
+static void handle_time_event(timenfo *t) {
+  struct appstate *s = &state[t->port];
+  capture_event(&rec, t);
+  if (quiet || (stats_interval > 0 && t->msg == 0xf8)) {
+    clkinfo ci;
+    update_state(s, t, &ci);
+    if (stats_interval > 0) {
+      stats_event(s, t, &ci);
+    }
+  } else if (batch_output) {
+    format_time_event(s, t, &output);
+  } else {
+    print_time_event(s, t);
+  }
+}
+
+/**
+ * publish state of all ports in shared memory
+ */
+static void shm_publish(void) {
+  int i;
+  mclk_shm_write_begin(&shm->hdr);
+  shm->n_ports = n_inputs;
+  shm->dropped = total_overflows();
+  for (i = 0; i < n_inputs; ++i) {
+    const struct appstate *s = &state[i];
+    struct mclk_shm_port *p = &shm->port[i];
+    p->rolling  = s->transport != 0;
+    p->song_pos = s->clk.bp;
+    p->ticks    = s->ticks;
+    p->bpm      = s->clk.valid ? s->clk.bpm : 0;
+    p->flt_bpm  = s->clk.flt_bpm;
+    p->dll_err  = s->clk.err_valid ? 1e6 * s->clk.err / samplerate : 0;
+    p->max_err  = 1e6 * s->max_err / samplerate;
+  }
+  mclk_shm_write_end(&shm->hdr, jack_get_time());
+}
+
+/**
+ * network receive thread, queue packets for the main thread
+ */
+static void *net_thread(void *arg) {
+  struct pollfd pfd;
+  uint8_t buf[256];
+  pfd.fd = net_sock;
+  pfd.events = POLLIN;
+  while (run) {
+    netevent ne;
+    ssize_t n;
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    n = recv(net_sock, buf, sizeof(buf), 0);
+    ne.arrival = jack_get_time();
+    if (n <= 0 || mclk_net_decode(buf, n, &ne.pk)) {
+      continue;
+    }
+    if (jack_ringbuffer_write_space(net_rb) >= sizeof(netevent)) {
+      jack_ringbuffer_write(net_rb, (const char *) &ne, sizeof(netevent));
+      sem_post(&data_ready);
+    } else {
+      net_overflows++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * queue a message to be re-emitted on the output port
+ * @param time due time [usec], messages are kept in order
+ */
+static void emit_event(uint8_t msg, uint16_t pos, jack_time_t time) {
+  static jack_time_t last = 0;
+  emitevent e;
+  if (time < last) {
+    time = last;
+  }
+  last = time;
+  e.time = time;
+  e.msg = msg;
+  e.pos = pos;
+  if (jack_ringbuffer_write_space(emit_rb) >= sizeof(emitevent)) {
+    jack_ringbuffer_write(emit_rb, (const char *) &e, sizeof(emitevent));
+  } else {
+    emit_overflows++;
+  }
+}
+
+/**
+ * handle a received packet like a MIDI event (print, record, update DLL),
+ * and re-emit it after net_delay. Clock ticks are re-emitted at the time
+ * predicted by the DLL, which removes the network jitter. Lost ticks
+ * (gaps of the tick index) are filled in at the predicted time.
+ */
+static void handle_net_event(const netevent *ne) {
+  static int have_seq = 0;
+  static uint32_t last_seq = 0;
+  static uint64_t last_tick = 0;
+  struct appstate *s = &state[0];
+  const jack_time_t delay = net_delay * 1000.0;
+  timenfo t;
+
+  if (have_seq && ne->pk.seq != last_seq + 1) {
+    net_lost += ne->pk.seq - last_seq - 1;
+  }
+  have_seq = 1;
+  last_seq = ne->pk.seq;
+
+  memset(&t, 0, sizeof(timenfo));
+  if (ne->pk.msg == 0xf8 && s->sequence > 1
+      && ne->pk.tick > last_tick + 1 && ne->pk.tick - last_tick <= NET_MAX_FILL) {
+    uint64_t k;
+    for (k = last_tick + 1; k < ne->pk.tick; ++k) {
+      t.msg = 0xf8;
+      t.tme = llrint(s->dll.t1 * samplerate);
+      handle_time_event(&t);
+      emit_event(0xf8, 0, s->dll.t0 * 1e6 + delay);
+    }
+  }
+
+  t.msg = ne->pk.msg;
+  t.pos = ne->pk.msg == 0xf2 ? ne->pk.song_pos : 0;
+  t.tme = ne->arrival * samplerate / 1e6;
+  t.usec = ne->arrival;
+  handle_time_event(&t);
+
+  if (t.msg == 0xf8) {
+    last_tick = ne->pk.tick;
+    /* the DLL is running after the 2nd tick */
+    emit_event(0xf8, 0, (s->sequence >= 2 ? (jack_time_t) (s->dll.t0 * 1e6) : ne->arrival) + delay);
+  } else {
+    emit_event(t.msg, t.pos, ne->arrival + delay);
+  }
+}
+
+static void flush_output(void) {
+  capture_flush(&rec);
+  if (batch_output) {
+    ob_flush(&output);
+  } else {
+    fflush(stdout);
+  }
+}
+
+/**
+ * analyze a binary capture file, without JACK
+ * @return 0 on success, -1 on error
+ */
+static int replay(const char *path) {
+  struct stat st;
+  const uint8_t *data, *p, *end;
+  int rv = -1;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) || st.st_size < 6) {
+    fprintf(stderr, "cannot read capture file '%s'.\n", path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "cannot map capture file '%s'.\n", path);
+    return -1;
+  }
+  end = data + st.st_size;
+
+  if (memcmp(data, "MCLK", 4) || data[4] != CAPTURE_VERSION) {
+    fprintf(stderr, "'%s' is not a jack_mclk_dump capture file.\n", path);
+    goto out;
+  }
+  n_inputs = data[5];
+  if (n_inputs < 1 || n_inputs > MAX_INPUTS) {
+    fprintf(stderr, "invalid number of inputs in capture file.\n");
+    goto out;
+  }
+  if (n_inputs > 1) {
+    newline = '\n';
+  }
+
+  memset(state, 0, sizeof(state));
+  p = data + 6;
+  while (p < end) {
+    uint64_t sr, base, count, v;
+    timenfo t;
+    memset(&t, 0, sizeof(timenfo));
+    if (*p++ != CAPTURE_BLOCK
+	|| !(p = varint_get(p, end, &sr))
+	|| !(p = varint_get(p, end, &base))
+	|| !(p = varint_get(p, end, &count))
+	|| sr == 0) {
+      fprintf(stderr, "invalid block header in capture file.\n");
+      goto out;
+    }
+    samplerate = sr;
+    t.tme = base;
+    while (count-- > 0) {
+      t.pos = 0;
+      if (p + 1 >= end) goto truncated;
+      t.msg = *p++;
+      t.port = *p++;
+      if (t.port >= n_inputs) goto truncated;
+      if (t.msg == 0xf2) {
+	if (!(p = varint_get(p, end, &v))) goto truncated;
+	t.pos = v;
+      }
+      if (!(p = varint_get(p, end, &v))) goto truncated;
+      t.tme += v;
+      handle_time_event(&t);
+    }
+    flush_output();
+  }
+  rv = 0;
+  goto out;
+
+truncated:
+  fprintf(stderr, "capture file is truncated.\n");
+  flush_output();
+  rv = 0;
+out:
+  print_stats_total();
+  munmap((void*) data, st.st_size);
+  return rv;
+}
+
+
 static void wearedone(int sig) {
   fprintf(stderr,"caught signal - shutting down.\n");
   run=0;
-  pthread_cond_signal (&data_ready);
+  sem_post (&data_ready); // async-signal-safe
 }
 
 
@@ -366,26 +1259,132 @@ static void wearedone(int sig) {
 
 static struct option const long_options[] =
 {
+  {"adaptive", no_argument, 0, 'a'},
   {"bandwidth", required_argument, 0, 'b'},
+  {"batch", no_argument, 0, 'w'},
   {"help", no_argument, 0, 'h'},
+  {"inputs", required_argument, 0, 'i'},
+  {"max-bpm", required_argument, 0, 'M'},
+  {"max-wakeup-rate", required_argument, 0, 'm'},
+  {"net", required_argument, 0, 'N'},
+  {"net-delay", required_argument, 0, 'D'},
   {"newline", no_argument, 0, 'n'},
+  {"no-mlockall", no_argument, 0, 'U'},
+  {"order", required_argument, 0, 'o'},
+  {"ppqn", required_argument, 0, 'p'},
+  {"queue-size", required_argument, 0, 'Q'},
+  {"quiet", no_argument, 0, 'q'},
+  {"record", required_argument, 0, 'r'},
+  {"replay", required_argument, 0, 'R'},
+  {"shm", required_argument, 0, 'E'},
+  {"stats", required_argument, 0, 's'},
+  {"timestamp", required_argument, 0, 't'},
   {"version", no_argument, 0, 'V'},
   {NULL, 0, NULL, 0}
 };
 
 static void usage (int status) {
   printf ("jack_mclk_dump - JACK MIDI Clock dump.\n\n");
-  printf ("Usage: jack_mclk_dump [ OPTIONS ] [JACK-port]\n\n");
+  printf ("Usage: jack_mclk_dump [ OPTIONS ] [JACK-port]*\n\n");
   printf ("Options:\n\
+  -a, --adaptive             adapt the DLL bandwidth: start wide, narrow down\n\
+                             to --bandwidth, re-widen after tempo steps\n\
   -b, --bandwidth <1/Hz>     DLL bandwidth in 1/Hz (default: 6.0)\n\
+  -D, --net-delay <ms>       delay of the clock re-emitted in network\n\
+                             receive mode (default: 20)\n\
+  -E, --shm <name>           export state of all ports in POSIX shared\n\
+                             memory, e.g. /mclk_dump\n\
   -h, --help                 display this help and exit\n\
+  -i, --inputs <num>         number of input ports to monitor (default: 1)\n\
+  -m, --max-wakeup-rate <Hz> limit how often the output thread is woken up\n\
+                             (default: 0, once per cycle with new data)\n\
+  -M, --max-bpm <bpm>        max expected tempo, used to size the event\n\
+                             queue (default: 300)\n\
   -n, --newline              print a newline after each Tick\n\
+  -N, --net <addr>[:<port>]  receive clock from jack_midi_clock's net output\n\
+                             instead of a JACK port, and re-emit it on\n\
+                             the port mclk_out\n\
+  -o, --order <2|3>          order of the DLL, 3 follows tempo ramps\n\
+                             (default: 2)\n\
+  -p, --ppqn <num>           clock ticks per quarter note of the source\n\
+                             (default: 24)\n\
+  -q, --quiet                do not print events (e.g. when recording)\n\
+  -Q, --queue-size <num>     size of the event queue (default: auto)\n\
+  -r, --record <file>        write received events to a binary capture file\n\
+  -R, --replay <file>        analyze a capture file instead of connecting\n\
+                             to JACK\n\
+  -s, --stats <sec>          print statistics every <sec> seconds instead\n\
+                             of every clock tick\n\
+  -t, --timestamp <source>   timebase of event times: counter (samples\n\
+                             since start, default), frames (JACK frame\n\
+                             time), usec (JACK frame time, printed in\n\
+                             microseconds)\n\
+  -U, --no-mlockall          only lock the memory used in realtime context,\n\
+                             not the whole process\n\
   -V, --version              print version information and exit\n\
+  -w, --batch                format output without stdio and write it once\n\
+                             per wakeup (reduces CPU load when logging)\n\
 \n");
   printf ("\n\
 This tool subscribes to a JACK Midi Port and prints received Midi\n\
 beat clock and BPM to stdout.\n\
 \n\
+With -i, multiple input ports are monitored by a single client, each with\n\
+its own state and DLL. Events are timestamped using a common timebase,\n\
+printed in chronological order and prefixed with the port number.\n\
+The given JACK-ports are connected to the inputs in order; with a single\n\
+input, all given ports are connected to it.\n\
+\n\
+Received events can be recorded to a compact binary file with -r, which\n\
+can later be analyzed with -R, faster than realtime and without a JACK\n\
+server. All other options apply to replay as well.\n\
+\n\
+Events are passed from the JACK process thread to the output thread via\n\
+a queue. If the output thread can not keep up, events are dropped and a\n\
+warning is printed to stderr. The default size is sufficient for one\n\
+second of clock at the --max-bpm tempo on all inputs.\n\
+\n\
+The tempo is filtered by a delay-locked loop (DLL) per port. By default it\n\
+is a 2nd order loop with a fixed bandwidth. With -o 3, the loop also tracks\n\
+the change of the tempo and follows ramps without lag. With -a, the loop\n\
+starts 16 times wider than -b and narrows as long as the error variance\n\
+falls. Three consecutive ticks of the same sign beyond 4 standard deviations\n\
+are considered a tempo step and widen the loop again.\n\
+\n\
+With -s, clock ticks are not printed. Instead the deviation of each tick\n\
+from the time predicted by the DLL is collected per port, and a summary\n\
+(STAT: mean, standard deviation, percentiles and maximum) is printed every\n\
+<sec> seconds of received clock. On exit, a summary of the whole run\n\
+(TOTAL) and a histogram with 4 buckets per octave (HIST) are printed.\n\
+Percentiles are upper bounds of the histogram bucket.\n\
+\n\
+Event times are printed after the '@'. By default they count samples since\n\
+the client was activated, which is compact but skips the frames of cycles\n\
+lost in an xrun. With -t frames, events are timestamped with the JACK frame\n\
+time, jack_last_frame_time() plus the event's offset. With -t usec, the\n\
+frame time is also converted with jack_frames_to_time() and printed in\n\
+microseconds of jack_get_time(), to correlate events with other traces and\n\
+between machines. Tempo, DLL and statistics always use samples.\n\
+\n\
+With -E, tempo, DLL deviation, tick count and transport state of each port\n\
+and the number of dropped events are published in a shared memory segment\n\
+after each wakeup, for monitoring tools. The layout is described in\n\
+mclk_shm.h. It can be combined with -q to not print any events.\n\
+\n\
+With -N, the clock is received as UDP packets sent by a jack_midi_clock\n\
+output with a net=<addr>[:<port>] setting (multicast addresses are joined),\n\
+instead of a JACK MIDI port. Packets are timestamped when they arrive and\n\
+handled like MIDI events. The clock is re-emitted on the output port mclk_out\n\
+with the ticks placed at the time predicted by the DLL, delayed by -D to\n\
+absorb the network jitter. The delay should exceed two JACK periods plus the\n\
+network jitter. Lost ticks are detected by the tick index of the packets and\n\
+filled in when the next tick arrives, on time only if the delay also exceeds\n\
+a clock tick interval. The given JACK-ports are connected to mclk_out.\n\
+\n\
+The memory used in realtime context (ring buffers, port state and the stack\n\
+of the process thread) is locked and prefaulted at startup. By default the\n\
+whole process is locked as well, -U skips that to reduce the resident memory.\n\
+\n\
 See also: jack_midi_clock(1)\n\
 \n");
   printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
@@ -398,10 +1397,27 @@ static int decode_switches (int argc, char **argv) {
   int c;
 
   while ((c = getopt_long (argc, argv,
+	 "a"  /* adaptive */
 	 "b:" /* bandwidth */
+	 "D:" /* net-delay */
+	 "E:" /* shm */
 	 "h"  /* help */
+	 "i:" /* inputs */
+	 "m:" /* max-wakeup-rate */
+	 "M:" /* max-bpm */
 	 "n"  /* newline */
-	 "V", /* version */
+	 "N:" /* net */
+	 "o:" /* order */
+	 "p:" /* ppqn */
+	 "q"  /* quiet */
+	 "Q:" /* queue-size */
+	 "r:" /* record */
+	 "R:" /* replay */
+	 "s:" /* stats */
+	 "t:" /* timestamp */
+	 "U"  /* no-mlockall */
+	 "V"  /* version */
+	 "w", /* batch */
 	 long_options, (int *) 0)) != EOF) {
     switch (c) {
       case 'b':
@@ -411,9 +1427,101 @@ static int decode_switches (int argc, char **argv) {
 	  dll_bandwidth = 6.0;
 	}
 	break;
+      case 'a':
+	dll_adaptive = 1;
+	break;
+      case 'D':
+	net_delay = atof(optarg);
+	if (net_delay < 0 || net_delay > 1000) {
+	  fprintf(stderr, "Invalid network delay, should be 0 <= ms <= 1000. Using 20.\n");
+	  net_delay = 20;
+	}
+	break;
+      case 'E':
+	shm_name = optarg;
+	break;
+      case 'o':
+	dll_order = atoi(optarg);
+	if (dll_order != 2 && dll_order != 3) {
+	  fprintf(stderr, "Invalid DLL order, should be 2 or 3. Using 2.\n");
+	  dll_order = 2;
+	}
+	break;
+      case 'i':
+	n_inputs = atoi(optarg);
+	if (n_inputs < 1 || n_inputs > MAX_INPUTS) {
+	  fprintf(stderr, "Invalid number of inputs, should be 1 <= num <= %d. Using 1.\n", MAX_INPUTS);
+	  n_inputs = 1;
+	}
+	break;
+      case 'm':
+	max_wakeup_rate = atof(optarg);
+	if (max_wakeup_rate < 0) {
+	  fprintf(stderr, "Invalid wakeup rate, should be >= 0. Using 0 (unlimited).\n");
+	  max_wakeup_rate = 0;
+	}
+	break;
+      case 'M':
+	max_bpm = atof(optarg);
+	if (max_bpm < 1 || max_bpm > 10000) {
+	  fprintf(stderr, "Invalid max BPM, should be 1 <= bpm <= 10000. Using 300.\n");
+	  max_bpm = 300;
+	}
+	break;
       case 'n':
 	newline = '\n';
 	break;
+      case 'N':
+	net_spec = optarg;
+	break;
+      case 'p':
+	ppqn = atoi(optarg);
+	if (ppqn < 1 || ppqn > 960) {
+	  fprintf(stderr, "Invalid ppqn, should be 1 <= num <= 960. Using %d.\n", MCLK_PPQN);
+	  ppqn = MCLK_PPQN;
+	}
+	break;
+      case 'q':
+	quiet = 1;
+	break;
+      case 'Q':
+	queue_size = atoi(optarg);
+	if (queue_size < 0 || queue_size > 1048576) {
+	  fprintf(stderr, "Invalid queue size, should be 0 <= num <= 1048576. Using auto.\n");
+	  queue_size = 0;
+	}
+	break;
+      case 'r':
+	record_path = optarg;
+	break;
+      case 'R':
+	replay_path = optarg;
+	break;
+      case 's':
+	stats_interval = atof(optarg);
+	if (stats_interval < 0 || stats_interval > 86400) {
+	  fprintf(stderr, "Invalid statistics interval, should be 0 <= sec <= 86400. Disabled.\n");
+	  stats_interval = 0;
+	}
+	break;
+      case 't':
+	if (!strcmp(optarg, "counter")) {
+	  time_source = TS_COUNTER;
+	} else if (!strcmp(optarg, "frames")) {
+	  time_source = TS_FRAMES;
+	} else if (!strcmp(optarg, "usec")) {
+	  time_source = TS_USEC;
+	} else {
+	  fprintf(stderr, "Invalid timestamp source, should be counter, frames or usec. Using counter.\n");
+	  time_source = TS_COUNTER;
+	}
+	break;
+      case 'U':
+	lock_all = 0;
+	break;
+      case 'w':
+	batch_output = 1;
+	break;
       case 'V':
 	printf ("jack_mclk_dump version %s\n\n", VERSION);
 	printf ("Copyright (C) GPL 2013 Robin Gareus <robin@gareus.org>\n");
@@ -434,14 +1542,62 @@ int main (int argc, char ** argv) {
 
   decode_switches (argc, argv);
 
+  if (replay_path) {
+    return replay(replay_path) ? EXIT_FAILURE : 0;
+  }
+
+  if (net_spec && n_inputs > 1) {
+    fprintf(stderr, "Network receive mode uses a single port, ignoring --inputs.\n");
+    n_inputs = 1;
+  }
+
+  if (n_inputs > 1) {
+    /* overwriting lines of interleaved ports is not useful */
+    newline = '\n';
+  }
+
+  sem_init(&data_ready, 0, 0);
+
+  if (record_path && capture_open(&rec, record_path))
+    goto out;
+
   if (init_jack("jack_mclk_dump"))
     goto out;
+
+  if (max_wakeup_rate > 0) {
+    wakeup_interval = samplerate / max_wakeup_rate;
+  }
   if (jack_portsetup())
     goto out;
 
-  rb = jack_ringbuffer_create(RBSIZE * sizeof(timenfo));
+  if (queue_size <= 0) {
+    queue_size = auto_queue_size();
+  }
+  if (!(rb = jack_ringbuffer_create(queue_size * sizeof(timenfo)))) {
+    fprintf(stderr, "cannot allocate event queue of %d events.\n", queue_size);
+    goto out;
+  }
 
-  if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
+  if (net_spec) {
+    struct sockaddr_in addr;
+    if (mclk_net_addr(net_spec, &addr) || (net_sock = mclk_net_receiver(&addr)) < 0) {
+      fprintf(stderr, "cannot receive from network address '%s'.\n", net_spec);
+      goto out;
+    }
+    net_rb = jack_ringbuffer_create(queue_size * sizeof(netevent));
+    emit_rb = jack_ringbuffer_create(queue_size * sizeof(emitevent));
+    if (!net_rb || !emit_rb) {
+      fprintf(stderr, "cannot allocate network event queues.\n");
+      goto out;
+    }
+  }
+
+  if (shm_name && !(shm = mclk_shm_create(shm_name, sizeof(struct mclk_shm_dump), MCLK_SHM_DUMP))) {
+    fprintf(stderr, "cannot create shared memory '%s'.\n", shm_name);
+    goto out;
+  }
+
+  if (rt_lock()) {
     fprintf(stderr, "Warning: Can not lock memory.\n");
   }
 
@@ -450,16 +1606,23 @@ int main (int argc, char ** argv) {
     goto out;
   }
 
-  while (optind < argc)
-    port_connect(argv[optind++]);
+  for (i = 0; optind < argc; ++i)
+    port_connect(n_inputs > 1 ? i % n_inputs : 0, argv[optind++]);
 
 #ifndef _WIN32
   signal(SIGHUP, wearedone);
   signal(SIGINT, wearedone);
 #endif
 
-  memset(&state, 0, sizeof(struct appstate));
-  pthread_mutex_lock (&msg_thread_lock);
+  memset(state, 0, sizeof(state));
+
+  if (net_sock >= 0) {
+    if (pthread_create(&net_thread_id, NULL, net_thread, NULL)) {
+      fprintf(stderr, "cannot start network receive thread.\n");
+      goto out;
+    }
+    net_thread_running = 1;
+  }
 
   /* all systems go */
 
@@ -469,15 +1632,27 @@ int main (int argc, char ** argv) {
       /* process Mclk event */
       timenfo t;
       jack_ringbuffer_read(rb, (char*) &t, sizeof(timenfo));
-      print_time_event(&state, &t);
+      handle_time_event(&t);
     }
-    fflush(stdout);
-    pthread_cond_wait (&data_ready, &msg_thread_lock);
+    while (net_rb && jack_ringbuffer_read_space (net_rb) >= sizeof(netevent)) {
+      netevent ne;
+      jack_ringbuffer_read(net_rb, (char*) &ne, sizeof(netevent));
+      handle_net_event(&ne);
+    }
+    flush_output();
+    report_overflows();
+    if (shm) {
+      shm_publish();
+    }
+    sem_wait (&data_ready);
   }
-  pthread_mutex_unlock (&msg_thread_lock);
+  report_overflows();
+  print_stats_total();
 
 out:
   cleanup();
+  capture_close(&rec);
+  sem_destroy(&data_ready);
   return 0;
 }
 /* vi:set ts=8 sts=2 sw=2: */
@@ -26,11 +26,31 @@
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
+#include <jack/ringbuffer.h>
 
 #include <sys/mman.h>
 
+#ifdef WITH_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "mclk_core.h"
+#include "mclk_mem.h"
+
 #ifndef WIN32
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mclk_shm.h"
+#include "mclk_net.h"
+#endif
+
+/* outputs that are not a JACK port: ALSA rawmidi, network */
+#if defined(WITH_ALSA) || !defined(WIN32)
+#define HAVE_QUEUED_OUTPUTS
+#include <jack/thread.h>
 #endif
 
 /* bitwise flags -- used w/ msg_filter */
@@ -46,17 +66,159 @@ struct bbtpos {
   int32_t   beat;           /**< current beat-within-bar */
   int32_t   tick;           /**< current tick-within-beat */
   double    bar_start_tick; /**< number of ticks that have elapsed between frame 0 and the first beat of the current measure. */
+  float     beats_per_bar;  /**< time signature "numerator" */
+  double    ticks_per_beat; /**< number of ticks within a beat */
+  int64_t   song_pos;       /**< song position in MIDI beats, -1 if the current position has no BBT */
+};
+
+#define MAX_OUTPUTS 32
+#define MAX_PHASE_PPQN 960
+
+/* MIDI Time Code frame rates, the index is the rate code of MTC messages */
+enum MtcRate {
+  MTC_NONE = -1,
+  MTC_24 = 0,
+  MTC_25,
+  MTC_29_97DF, /**< 30000/1001 fps, drop-frame */
+  MTC_30
+};
+
+static const struct {
+  int num, den; /**< frames per second: num / den */
+  int fps;      /**< nominal frames per second of the time code */
+} mtc_rates[] = {
+  [MTC_24]      = { 24, 1, 24 },
+  [MTC_25]      = { 25, 1, 25 },
+  [MTC_29_97DF] = { 30000, 1001, 30 },
+  [MTC_30]      = { 30, 1, 30 },
+};
+
+/* MIDI clock output port and its settings */
+struct mclk_output {
+  const char  *name;        /**< port name */
+  const char  *connect;     /**< port to connect to, may be NULL */
+  const char  *rawmidi;     /**< ALSA rawmidi device to use instead of a JACK port, may be NULL */
+  const char  *net;         /**< network address to send to instead of a JACK port, may be NULL */
+  short        port_filter; /**< bitwise flags, MSG_NO_.. of this port */
+  short        msg_filter;  /**< effective flags: port_filter | global msg_filter */
+  int32_t      offset;      /**< clock offset in samples, positive values delay */
+  int          ppqn;        /**< clock ticks per quarter note */
+  int          divider;     /**< only send every Nth clock tick */
+  double       resync_delay; /**< seconds between 'pos' and 'continue' message, < 0: use -d */
+  short        wrap_position; /**< wrap song position instead of not sending it */
+  enum MtcRate mtc_rate;    /**< also send MIDI Time Code at this rate */
+  volatile jack_nframes_t latency; /**< playback latency, updated by latency callback */
+
+  /* realtime state */
+  jack_port_t *port;        /**< NULL for rawmidi and network outputs */
+  void        *buf;         /**< port buffer of current cycle */
+  struct queued_out *queue; /**< rawmidi or network output, NULL: JACK port */
+  int64_t      song_position_sync;
+  int64_t      next_k;      /**< index of next clock tick to send (see tickphase) */
+  int          tick_period; /**< phase ticks per sent clock tick */
+  int          tick_count;  /**< phase ticks since last start/continue, modulo tick_period */
+  uint32_t     cycle_clocks; /**< initial beat ticks sent in the current cycle, for statistics */
+  int64_t      mtc_start;   /**< transport position of the first sample of the cycle, for this port */
+  int64_t      mtc_next_q;  /**< index of next MTC quarter frame to send */
+  int64_t      mtc_end_q;   /**< index of first MTC quarter frame after the current cycle */
+};
+
+/* clock tick positions.
+ * tick k is located at origin + (k_base + k) * interval, unless a tempo
+ * ramp is set: then the tick rate (1/interval) changes linearly from r0
+ * to r1 over [ramp_start, ramp_start + ramp_len), and is constant after.
+ *
+ * origin and interval use 32.32 fixed point, so the position of a tick
+ * is exact and does not depend on how many ticks were sent before.
+ * tp_fixed_pos() requires k_base + k < 2^32: advance_anchor() moves the
+ * origin to the anchor (exactly) once k_base exceeds TP_MAX_K_BASE.
+ */
+#define TP_MAX_K_BASE (INT64_C(1) << 31)
+
+typedef struct {
+  int64_t  origin;      /**< position of tick 0, integer part [samples] */
+  uint32_t origin_frac; /**< position of tick 0, fractional part [2^-32 samples] */
+  int64_t  k_base;      /**< index of the anchor tick relative to origin */
+  uint64_t interval;    /**< clock tick interval, 32.32 fixed point [samples] */
+  int64_t  ramp_start;  /**< start of tempo ramp [samples] */
+  double   ramp_len;    /**< length of tempo ramp, 0: constant tempo */
+  double   r0, r1;      /**< tick rate at start and end of the ramp [1/samples] */
+  double   g_anchor;    /**< ticks from ramp_start to the anchor */
+} tickphase;
+
+/* look-ahead schedule: positions of the upcoming ticks at constant tempo,
+ * tick n (counted from the origin, k_base + k) is stored at pos[n % size].
+ * The entries depend only on origin and interval, and remain valid until
+ * either changes (tempo change, locate, transport state change).
+ */
+#define SCHED_SIZE (1024) /* power of two */
+
+typedef struct {
+  int64_t  origin;      /**< origin of the tickphase the schedule belongs to */
+  uint32_t origin_frac;
+  uint64_t interval;
+  int64_t  n0;          /**< first tick in the schedule */
+  int64_t  len;         /**< number of ticks in the schedule, 0: invalid */
+  int64_t  pos[SCHED_SIZE]; /**< tick positions, rounded [samples] */
+} tickschedule;
+
+/* realtime statistics, accumulated in process() */
+struct mclk_stats {
+  uint32_t cycles;    /**< process cycles */
+  uint32_t rolling;   /**< cycles with transport rolling and known tempo */
+  uint32_t ticks;     /**< clock ticks sent, all outputs */
+  uint32_t max_ticks; /**< max clock ticks per cycle and output */
+  uint32_t catchup;   /**< cycles in which clock ticks were skipped */
+  uint32_t skipped;   /**< clock ticks that were skipped */
+  uint32_t failed;    /**< messages that could not be queued (jack_midi_event_reserve) */
+  uint32_t max_dev;   /**< max deviation of a tick from its nominal position [samples] */
+  uint32_t xstate;    /**< transport state of the last cycle */
+  double   bpm;       /**< tempo of the clock in the last cycle, 0: no clock */
 };
 
 /* jack connection */
-static jack_port_t            *mclk_output_port = NULL;
 static jack_client_t          *j_client = NULL;
+static struct mclk_output      outputs[MAX_OUTPUTS];
+static int                     n_outputs = 0;
+
+/* runtime parameter update, sent from the control thread to process() */
+struct mclk_ctrl {
+  enum {
+    CTRL_BPM = 0,    /**< user_bpm */
+    CTRL_FORCE_BPM,  /**< force_bpm */
+    CTRL_MSG_FILTER, /**< msg_filter */
+    CTRL_JITTER      /**< jitter_level */
+  } param;
+  double value;
+};
+
+/* tempo follower, derives the tempo from MIDI clock or taps on an input port */
+struct mclk_follow {
+  jack_port_t    *port;
+  const char     *connect;     /**< port to connect to, may be NULL */
+  DelayLockedLoop dll;
+  int64_t         now;         /**< time of the current cycle [samples] */
+  jack_nframes_t  last_frame;  /**< jack_last_frame_time() of the current cycle */
+  int64_t         prev;        /**< time of the previous event [samples] */
+  int             ppqn;        /**< events per quarter note: 24 (clock) or 1 (tap) */
+  int             sequence;    /**< events since (re)locking */
+  double          period;      /**< filtered event interval [samples] */
+  double          bpm;         /**< followed tempo, 0: no lock */
+};
 
 /* application state */
 static jack_transport_state_t  m_xstate = JackTransportStopped;
-static double                  mclk_last_tick = 0.0;
-static int64_t                 song_position_sync = -1;
+static tickphase               mclk_phase;
+static tickschedule            mclk_sched;
+static double                  prev_interval = 0; /**< clock tick interval of previous cycle */
+static int64_t                 next_cycle_start = 0;
+static int64_t                 next_mtc_start = -1; /**< expected transport position of the next cycle */
 static struct bbtpos           last_xpos; /** keep track of transport locates */
+static struct mclk_stats       rt_stats;
+static struct mclk_follow      follow;
+static int                     phase_ppqn = MCLK_PPQN; /**< tick rate of the phase, multiple of all outputs' ppqn */
+static jack_ringbuffer_t      *stats_rb = NULL;
+static jack_ringbuffer_t      *ctrl_rb = NULL;
 
 static volatile enum {
   Init,
@@ -67,6 +229,11 @@ static volatile enum {
 #ifndef JACK_INTERNAL_CLIENT
 static int wake_main_read = -1;
 static int wake_main_write = -1;
+static pthread_t stats_thread_id;
+static FILE *stats_file = NULL;
+static pthread_t ctrl_thread_id;
+static int ctrl_fd = -1;
+static struct mclk_shm_generator *shm = NULL;
 #endif
 
 /* commandline options */
@@ -75,11 +242,35 @@ static short    force_bpm  = 0;
 static short    tempo_is_qnpm = 1;  /** tempo is quarter notes per minute instead of BPM */
 static short    msg_filter = 0;     /** bitwise flags, MSG_NO_.. */
 static double   resync_delay = 2.0; /**< seconds between 'pos' and 'continue' message */
+static short    compensate_latency = 0; /**< send clock ahead of time by the port's playback latency */
+static short    interpolate_tempo = 0;  /**< ramp tempo between cycles */
+static int      sched_cycles = 4;       /**< cycles to pre-compute clock ticks for, 0: off */
+static short    lock_all = 1;           /**< mlockall() in addition to locking the realtime data */
+static double   stats_interval = 0; /**< seconds between statistics reports, 0: off */
+static const char *stats_path = NULL;
+static const char *shm_name = NULL;  /**< export statistics to POSIX shared memory */
+static const char *ctrl_path = NULL; /**< unix socket for runtime control */
+static short    follow_tempo = 0;    /**< follow tempo of MIDI clock/taps on input port */
+static double   follow_bandwidth = 6.0; /**< DLL bandwidth of the follower [1/Hz] */
 
 #ifdef WITH_JITTER
+#define JITTER_TABLE_SIZE 4096 /* power of two */
+
+enum jitter_profile {
+  JITTER_UNIFORM = 0,
+  JITTER_GAUSS,
+  JITTER_USB,
+  JITTER_WANDER
+};
+
+static const char *jitter_profile_names[] = { "uniform", "gauss", "usb", "wander", NULL };
+
 static double   jitter_level = 0.0;
-static double   jitter_rand = 0.0;
+static int      jitter_profile = JITTER_UNIFORM;
+static uint32_t jitter_seed = 0; /**< 0: random */
 static uint32_t _rseed = 1;
+static float    jitter_table[JITTER_TABLE_SIZE]; /**< deviation per tick -1..+1 */
+static uint32_t jitter_idx = 0;
 
 static float randf() {
         // 31bit Park-Miller-Carta Pseudo-Random Number Generator
@@ -93,6 +284,51 @@ static float randf() {
         return (_rseed = lo) / 1073741824.f - 1.f;
 }
 
+/**
+ * precompute jitter table, process() only reads it.
+ * All profiles are normalized to -1..+1 (scaled by jitter_level).
+ */
+static void jitter_init(void) {
+  int burst = 0;
+  int i;
+  _rseed = jitter_seed ? jitter_seed : jack_get_time ();
+  _rseed &= 0x7fffffff;
+  if (_rseed == 0 || _rseed == 0x7fffffff) _rseed = 1;
+
+  for (i = 0; i < JITTER_TABLE_SIZE; ++i) {
+    float v = 0;
+    switch (jitter_profile) {
+      case JITTER_UNIFORM:
+	v = randf();
+	break;
+      case JITTER_GAUSS:
+	{
+	  /* Box-Muller, sigma = 1/3, clamped at 3 sigma */
+	  const float u1 = .5f + .5f * randf();
+	  const float u2 = randf();
+	  v = sqrtf(-2.f * logf(u1 > 1e-9f ? u1 : 1e-9f)) * cosf(M_PI * u2) / 3.f;
+	  if (v < -1.f) v = -1.f;
+	  if (v >  1.f) v =  1.f;
+	}
+	break;
+      case JITTER_USB:
+	/* late only, quantized to quarters of the level, in bursts:
+	 * each block of 16 ticks is either quiet or jittery */
+	if ((i & 15) == 0) {
+	  burst = randf() > 0;
+	}
+	v = burst ? ceilf((.5f + .5f * randf()) * 4.f) / 4.f : 0;
+	break;
+      case JITTER_WANDER:
+	/* slow periodic drift over 512 ticks, with some noise */
+	v = .9f * sinf(2.f * M_PI * i / 512.f) + .1f * randf();
+	break;
+    }
+    jitter_table[i] = v;
+  }
+  jitter_idx = 0;
+}
+
 #endif
 
 /* MIDI System Real-Time Messages
@@ -104,6 +340,331 @@ static float randf() {
 #define MIDI_RT_CONTINUE (0xFB)
 #define MIDI_RT_STOP     (0xFC)
 
+#ifdef HAVE_QUEUED_OUTPUTS
+/* ALSA rawmidi and network outputs.
+ * process() collects the messages of a cycle, and converts their sample
+ * offsets to absolute time when the cycle is complete. They are sent to
+ * the device at that time by a realtime thread, one period after the cycle,
+ * the same as the JACK MIDI backend does for a port.
+ */
+
+#define QUEUE_MAX_EVENTS 512 /**< per cycle and output */
+#define QUEUE_SIZE      4096 /**< events queued for the output thread, per output */
+#define NET_TTL            1 /**< multicast time-to-live: local network */
+
+struct queued_event {
+  jack_time_t    time;     /**< due time, jack_get_time() [usec] */
+  jack_nframes_t offset;   /**< sample offset in the cycle */
+  float          bpm;      /**< tempo of the cycle */
+  uint8_t        size;
+  uint8_t        data[11];
+};
+
+struct queued_out {
+  jack_ringbuffer_t *rb;    /**< events from process() to the output thread */
+  struct queued_event pending[QUEUE_MAX_EVENTS]; /**< events of the current cycle */
+  int                n_pending;
+#ifdef WITH_ALSA
+  snd_rawmidi_t     *handle; /**< rawmidi device, NULL: network */
+#endif
+#ifndef WIN32
+  int                sock;  /**< network socket, -1: rawmidi */
+  struct sockaddr_in addr;
+  uint32_t           seq;   /**< packets sent */
+  uint64_t           tick;  /**< clock ticks since song start */
+  int                ppqn;
+#endif
+};
+
+static jack_native_thread_t queue_thread_id;
+static int queue_running = 0;
+static struct mclk_arena queue_arena; /**< locked memory of all queued outputs */
+
+/**
+ * reserve space for a message of the current cycle
+ */
+static jack_midi_data_t *queue_reserve(struct queued_out *q, jack_nframes_t time, size_t size) {
+  struct queued_event *ev;
+  if (q->n_pending >= QUEUE_MAX_EVENTS || size > sizeof(ev->data)) {
+    return NULL;
+  }
+  ev = &q->pending[q->n_pending++];
+  ev->offset = time;
+  ev->size = size;
+  return ev->data;
+}
+
+/**
+ * timestamp messages of the current cycle and pass them to the output thread
+ */
+static void queue_flush(jack_nframes_t nframes) {
+  /* messages are due one period after the cycle, like those of a JACK MIDI port */
+  const jack_nframes_t base = jack_last_frame_time(j_client) + nframes;
+  int i, k;
+  for (i = 0; i < n_outputs; ++i) {
+    struct queued_out *q = outputs[i].queue;
+    if (!q) {
+      continue;
+    }
+    for (k = 0; k < q->n_pending; ++k) {
+      struct queued_event *ev = &q->pending[k];
+      if (jack_ringbuffer_write_space(q->rb) < sizeof(struct queued_event)) {
+	rt_stats.failed++;
+	continue;
+      }
+      ev->time = jack_frames_to_time(j_client, base + ev->offset);
+      ev->bpm = rt_stats.bpm;
+      jack_ringbuffer_write(q->rb, (const char *) ev, sizeof(struct queued_event));
+    }
+    q->n_pending = 0;
+  }
+}
+
+#ifndef WIN32
+/**
+ * send a clock, transport or song position message as network packet
+ */
+static void net_send(struct queued_out *q, const struct queued_event *ev) {
+  struct mclk_net_packet pk;
+  uint8_t buf[MCLK_NET_SIZE];
+
+  memset(&pk, 0, sizeof(pk));
+  pk.msg = ev->data[0];
+  switch (pk.msg) {
+    case MIDI_RT_START:
+      q->tick = 0;
+      break;
+    case 0xf2:
+      if (ev->size != 3) return;
+      pk.song_pos = ev->data[1] | (ev->data[2] << 7);
+      q->tick = (uint64_t) pk.song_pos * q->ppqn / SPP_PER_QN;
+      break;
+    case MIDI_RT_CLOCK:
+    case MIDI_RT_CONTINUE:
+    case MIDI_RT_STOP:
+      break;
+    default:
+      return; /* MTC is not sent */
+  }
+  pk.seq  = q->seq++;
+  pk.tick = q->tick;
+  pk.time = ev->time;
+  pk.bpm  = ev->bpm;
+  mclk_net_encode(buf, &pk);
+  sendto(q->sock, buf, sizeof(buf), 0, (struct sockaddr *) &q->addr, sizeof(q->addr));
+  if (pk.msg == MIDI_RT_CLOCK) {
+    ++q->tick;
+  }
+}
+#endif
+
+/**
+ * output thread, write messages to the devices when they are due
+ */
+static void *queue_thread(void *arg) {
+  mclk_mem_lock_stack();
+  while (queue_running) {
+    jack_time_t now = jack_get_time();
+    jack_time_t next = now + 1000;
+    int i;
+
+    for (i = 0; i < n_outputs; ++i) {
+      struct queued_out *q = outputs[i].queue;
+      struct queued_event ev;
+      if (!q) {
+	continue;
+      }
+      while (jack_ringbuffer_read_space(q->rb) >= sizeof(struct queued_event)) {
+	jack_ringbuffer_peek(q->rb, (char *) &ev, sizeof(struct queued_event));
+	if (ev.time > now) {
+	  if (ev.time < next) {
+	    next = ev.time;
+	  }
+	  break;
+	}
+#ifdef WITH_ALSA
+	if (q->handle) {
+	  snd_rawmidi_write(q->handle, ev.data, ev.size);
+	}
+#endif
+#ifndef WIN32
+	if (q->sock >= 0) {
+	  net_send(q, &ev);
+	}
+#endif
+	jack_ringbuffer_read_advance(q->rb, sizeof(struct queued_event));
+      }
+    }
+
+    now = jack_get_time();
+    if (next > now) {
+      usleep(next - now);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * close the rawmidi device or network socket of an output, and free
+ * its ring buffer. Also used to unwind a partially opened output.
+ * The queue itself is released with queue_arena.
+ */
+static void queue_close(struct mclk_output *o) {
+  struct queued_out *q = o->queue;
+  if (!q) {
+    return;
+  }
+#ifdef WITH_ALSA
+  if (q->handle) {
+    snd_rawmidi_drain(q->handle);
+    snd_rawmidi_close(q->handle);
+  }
+#endif
+#ifndef WIN32
+  if (q->sock >= 0) {
+    close(q->sock);
+  }
+#endif
+  if (q->rb) {
+    jack_ringbuffer_free(q->rb);
+  }
+  o->queue = NULL;
+}
+
+/**
+ * open the rawmidi device or network socket of an output
+ * @return 0 on success, -1 on error
+ */
+static int queue_open(struct mclk_output *o) {
+  struct queued_out *q;
+  if (!(q = mclk_arena_alloc(&queue_arena, sizeof(struct queued_out)))) {
+    return -1;
+  }
+  o->queue = q;
+#ifndef WIN32
+  q->sock = -1;
+  q->ppqn = o->ppqn;
+  if (o->net) {
+    if (mclk_net_addr(o->net, &q->addr) || (q->sock = mclk_net_sender(&q->addr, NET_TTL)) < 0) {
+      fprintf(stderr, "cannot open network output '%s'.\n", o->net);
+      queue_close(o);
+      return -1;
+    }
+  }
+#endif
+#ifdef WITH_ALSA
+  if (o->rawmidi) {
+    const int err = snd_rawmidi_open(NULL, &q->handle, o->rawmidi, 0);
+    if (err < 0) {
+      fprintf(stderr, "cannot open rawmidi device '%s': %s\n", o->rawmidi, snd_strerror(err));
+      q->handle = NULL;
+      queue_close(o);
+      return -1;
+    }
+  }
+#endif
+  if (!(q->rb = jack_ringbuffer_create(QUEUE_SIZE * sizeof(struct queued_event)))) {
+    fprintf(stderr, "cannot allocate queue of output '%s'.\n", o->name);
+    queue_close(o);
+    return -1;
+  }
+  if (jack_ringbuffer_mlock(q->rb)) {
+    fprintf(stderr, "Warning: Can not lock memory.\n");
+  }
+  return 0;
+}
+
+/**
+ * allocate the locked memory for all queued outputs
+ * @return 0 on success, -1 on error
+ */
+static int queue_init(void) {
+  int i, n = 0;
+  for (i = 0; i < n_outputs; ++i) {
+    if (outputs[i].rawmidi || outputs[i].net) {
+      ++n;
+    }
+  }
+  switch (mclk_arena_init(&queue_arena, n * (sizeof(struct queued_out) + MCLK_ARENA_ALIGN))) {
+    case 0:
+      return 0;
+    case 1:
+      fprintf(stderr, "Warning: Can not lock memory.\n");
+      return 0;
+    default:
+      fprintf(stderr, "cannot allocate output queues.\n");
+      return -1;
+  }
+}
+
+/**
+ * start the output thread, with the priority of the JACK process thread
+ * @return 0 on success, -1 on error
+ */
+static int queue_start(void) {
+  const int rt = jack_is_realtime(j_client);
+  int i;
+  for (i = 0; i < n_outputs; ++i) {
+    if (outputs[i].queue) {
+      break;
+    }
+  }
+  if (i == n_outputs) {
+    return 0;
+  }
+  queue_running = 1;
+  if (jack_client_create_thread(j_client, &queue_thread_id,
+	rt ? jack_client_real_time_priority(j_client) : 0, rt, queue_thread, NULL)) {
+    fprintf(stderr, "cannot start output thread.\n");
+    queue_running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * stop the output thread, close all rawmidi devices and sockets
+ */
+static void queue_stop(void) {
+  int i;
+  if (queue_running) {
+    queue_running = 0;
+    pthread_join(queue_thread_id, NULL);
+  }
+  for (i = 0; i < n_outputs; ++i) {
+    queue_close(&outputs[i]);
+  }
+  mclk_arena_free(&queue_arena);
+}
+#endif
+
+/**
+ * lock the data that is used in realtime context, and prefault it:
+ * ring buffers, transport and tick state, schedule and statistics.
+ * The output queues are locked by queue_init(), thread stacks by
+ * mclk_mem_lock_stack().
+ * @return 0 on success, -1 if some memory could not be locked
+ */
+static int rt_lock(void) {
+  int rv = 0;
+  if (stats_rb) rv |= jack_ringbuffer_mlock(stats_rb);
+  if (ctrl_rb)  rv |= jack_ringbuffer_mlock(ctrl_rb);
+  rv |= mclk_mem_lock(outputs, sizeof(outputs));
+  rv |= mclk_mem_lock(&mclk_phase, sizeof(mclk_phase));
+  rv |= mclk_mem_lock(&mclk_sched, sizeof(mclk_sched));
+  rv |= mclk_mem_lock(&last_xpos, sizeof(last_xpos));
+  rv |= mclk_mem_lock(&rt_stats, sizeof(rt_stats));
+  rv |= mclk_mem_lock(&follow, sizeof(follow));
+#ifdef WITH_JITTER
+  rv |= mclk_mem_lock(jitter_table, sizeof(jitter_table));
+#endif
+#ifndef JACK_INTERNAL_CLIENT
+  if (lock_all && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    rv = -1;
+  }
+#endif
+  return rv ? -1 : 0;
+}
 
 #ifndef JACK_INTERNAL_CLIENT
 static void wake_main_init(void)
@@ -160,38 +721,307 @@ static void cleanup(int sig) {
     jack_client_close (j_client);
     j_client = NULL;
   }
+#ifdef HAVE_QUEUED_OUTPUTS
+  queue_stop();
+#endif
+  if (stats_rb) {
+    client_state = Exit;
+    pthread_join(stats_thread_id, NULL);
+    jack_ringbuffer_free(stats_rb);
+    stats_rb = NULL;
+  }
+  if (stats_file && stats_file != stderr) {
+    fclose(stats_file);
+  }
+  stats_file = NULL;
+  if (ctrl_rb) {
+    client_state = Exit;
+    pthread_join(ctrl_thread_id, NULL);
+    jack_ringbuffer_free(ctrl_rb);
+    ctrl_rb = NULL;
+  }
+  if (ctrl_fd >= 0) {
+    close(ctrl_fd);
+    unlink(ctrl_path);
+    ctrl_fd = -1;
+  }
+  if (shm) {
+    mclk_shm_destroy(shm_name, shm);
+    shm = NULL;
+  }
 }
 
-#endif // JACK_INTERNAL_CLIENT
+/**
+ * accumulate statistics
+ */
+static void stats_add(struct mclk_stats *acc, const struct mclk_stats *s) {
+  acc->cycles  += s->cycles;
+  acc->rolling += s->rolling;
+  acc->ticks   += s->ticks;
+  acc->catchup += s->catchup;
+  acc->skipped += s->skipped;
+  acc->failed  += s->failed;
+  if (s->max_ticks > acc->max_ticks) acc->max_ticks = s->max_ticks;
+  if (s->max_dev > acc->max_dev) acc->max_dev = s->max_dev;
+  acc->xstate = s->xstate;
+  acc->bpm    = s->bpm;
+}
 
 /**
- * compare two BBT positions
+ * publish statistics since start in shared memory
  */
-static int pos_changed (struct bbtpos *xp0, jack_position_t *xp1) {
-  if (!(xp0->valid & JackPositionBBT)) return -1;
-  if (!(xp1->valid & JackPositionBBT)) return -2;
-  if (   xp0->bar  == xp1->bar
-      && xp0->beat == xp1->beat
-      && xp0->tick == xp1->tick
-     ) return 0;
-  return 1;
+static void shm_publish(const struct mclk_stats *s) {
+  mclk_shm_write_begin(&shm->hdr);
+  shm->transport = s->xstate;
+  shm->bpm       = s->bpm;
+  shm->cycles   += s->cycles;
+  shm->rolling  += s->rolling;
+  shm->ticks    += s->ticks;
+  shm->catchup  += s->catchup;
+  shm->skipped  += s->skipped;
+  shm->failed   += s->failed;
+  if (s->max_ticks > shm->max_ticks) shm->max_ticks = s->max_ticks;
+  if (s->max_dev > shm->max_dev) shm->max_dev = s->max_dev;
+  mclk_shm_write_end(&shm->hdr, jack_get_time());
 }
 
 /**
- * copy relevant BBT info from jack_position_t
+ * statistics thread.
+ * collect statistics from the realtime thread,
+ * export them and periodically print a summary.
  */
-static void remember_pos (struct bbtpos *xp0, jack_position_t *xp1) {
-  if (!(xp1->valid & JackPositionBBT)) return;
-  xp0->valid = xp1->valid;
-  xp0->bar   = xp1->bar;
-  xp0->beat  = xp1->beat;
-  xp0->tick  = xp1->tick;
+static void *stats_thread(void *arg) {
+  struct mclk_stats acc;
+  double elapsed = 0;
+  memset(&acc, 0, sizeof(struct mclk_stats));
+
+  while (client_state != Exit) {
+    struct mclk_stats s, upd;
+    usleep(100000);
+    elapsed += .1;
+
+    memset(&upd, 0, sizeof(struct mclk_stats));
+    while (jack_ringbuffer_read_space(stats_rb) >= sizeof(struct mclk_stats)) {
+      jack_ringbuffer_read(stats_rb, (char*) &s, sizeof(struct mclk_stats));
+      stats_add(&upd, &s);
+    }
+    if (shm && upd.cycles > 0) {
+      shm_publish(&upd);
+    }
+    stats_add(&acc, &upd);
+
+    if (stats_interval <= 0 || elapsed < stats_interval) {
+      continue;
+    }
+
+    fprintf(stats_file,
+	"stats: cycles: %u rolling: %u ticks: %u (max %u/cycle) catch-up: %u (%u ticks skipped) dropped: %u max-dev: %u[sm]\n",
+	acc.cycles, acc.rolling, acc.ticks, acc.max_ticks,
+	acc.catchup, acc.skipped, acc.failed, acc.max_dev);
+    fflush(stats_file);
+    memset(&acc, 0, sizeof(struct mclk_stats));
+    elapsed = 0;
+  }
+  return NULL;
+}
+
+/**
+ * start statistics thread
+ * @return 0 on success, -1 on error
+ */
+static int stats_init(void) {
+  if (shm_name && !(shm = mclk_shm_create(shm_name, sizeof(struct mclk_shm_generator), MCLK_SHM_GENERATOR))) {
+    fprintf(stderr, "cannot create shared memory '%s'.\n", shm_name);
+    return -1;
+  }
+  if (stats_path) {
+    if (!(stats_file = fopen(stats_path, "a"))) {
+      fprintf(stderr, "cannot open statistics file '%s'.\n", stats_path);
+      return -1;
+    }
+  } else {
+    stats_file = stderr;
+  }
+  /* plenty of space: statistics are accumulated in process() if the buffer is full */
+  if (!(stats_rb = jack_ringbuffer_create(64 * sizeof(struct mclk_stats)))) {
+    fprintf(stderr, "cannot allocate statistics buffer.\n");
+    return -1;
+  }
+  if (pthread_create(&stats_thread_id, NULL, stats_thread, NULL)) {
+    fprintf(stderr, "cannot start statistics thread.\n");
+    jack_ringbuffer_free(stats_rb);
+    stats_rb = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * parse a control command and queue it for process().
+ * @param cmd "<param> <value>"
+ * @return 0 on success, -1 on error
+ */
+static int ctrl_command(char *cmd) {
+  static short filter = -1; /* shadow of msg_filter, only modified here */
+  struct mclk_ctrl c;
+  char param[32];
+  double value;
+
+  if (filter < 0) {
+    filter = msg_filter;
+  }
+  if (sscanf(cmd, "%31s %lf", param, &value) != 2) {
+    return -1;
+  }
+
+  c.value = value;
+  if (!strcmp(param, "bpm") && value >= 0) {
+    c.param = CTRL_BPM;
+  } else if (!strcmp(param, "force-bpm")) {
+    c.param = CTRL_FORCE_BPM;
+  } else if (!strcmp(param, "position") || !strcmp(param, "transport")) {
+    const short flag = param[0] == 'p' ? MSG_NO_POSITION : MSG_NO_TRANSPORT;
+    filter = value ? filter & ~flag : filter | flag;
+    c.param = CTRL_MSG_FILTER;
+    c.value = filter;
+  } else if (!strcmp(param, "jitter") && value >= 0 && value <= 20) {
+#ifdef WITH_JITTER
+    c.param = CTRL_JITTER;
+    c.value = value / 100.0;
+#else
+    fprintf(stderr, "control: this version was compiled without support for jitter.\n");
+    return -1;
+#endif
+  } else {
+    return -1;
+  }
+
+  if (jack_ringbuffer_write_space(ctrl_rb) < sizeof(struct mclk_ctrl)) {
+    fprintf(stderr, "control: queue is full, '%s' ignored.\n", param);
+    return -1;
+  }
+  jack_ringbuffer_write(ctrl_rb, (const char *) &c, sizeof(struct mclk_ctrl));
+  return 0;
+}
+
+/**
+ * control thread.
+ * receive commands on the control socket, one per datagram.
+ */
+static void *ctrl_thread(void *arg) {
+  struct pollfd pfd;
+  pfd.fd = ctrl_fd;
+  pfd.events = POLLIN;
+
+  while (client_state != Exit) {
+    char buf[128];
+    ssize_t len;
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    if ((len = recv(ctrl_fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+      continue;
+    }
+    buf[len] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (ctrl_command(buf)) {
+      fprintf(stderr, "control: invalid command '%s'.\n", buf);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * create control socket and start control thread
+ * @return 0 on success, -1 on error
+ */
+static int ctrl_init(void) {
+  struct sockaddr_un addr;
+
+  if (strlen(ctrl_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "control socket path '%s' is too long.\n", ctrl_path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, ctrl_path);
+
+  if ((ctrl_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    fprintf(stderr, "cannot create control socket.\n");
+    return -1;
+  }
+  unlink(ctrl_path);
+  if (bind(ctrl_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    fprintf(stderr, "cannot bind control socket '%s'.\n", ctrl_path);
+    close(ctrl_fd);
+    ctrl_fd = -1;
+    return -1;
+  }
+
+  if (!(ctrl_rb = jack_ringbuffer_create(64 * sizeof(struct mclk_ctrl)))) {
+    fprintf(stderr, "cannot allocate control buffer.\n");
+    return -1;
+  }
+  if (pthread_create(&ctrl_thread_id, NULL, ctrl_thread, NULL)) {
+    fprintf(stderr, "cannot start control thread.\n");
+    jack_ringbuffer_free(ctrl_rb);
+    ctrl_rb = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // JACK_INTERNAL_CLIENT
+
+/**
+ * copy relevant BBT info from jack_position_t, and compare it
+ * to the previous position.
+ *
+ * The song position (14 bit integer) is calculated only if the
+ * position changed: if bar, beat, tick or the meter differ from
+ * the previous cycle. JACK changes unique_1 only on relocation, so
+ * the BBT fields are compared on every cycle.
+ *
+ * @return 1 if the position changed, 0 if not,
+ *  -1 if the previous and -2 if the current position has no BBT
+ */
+static int update_pos (struct bbtpos *xp0, jack_position_t *xp1) {
+  int rv;
+  if (!(xp1->valid & JackPositionBBT)) {
+    xp0->song_pos = -1;
+    return (xp0->valid & JackPositionBBT) ? -2 : -1;
+  }
+  if (!(xp0->valid & JackPositionBBT)) {
+    rv = -1;
+  } else if (   xp0->bar  == xp1->bar
+             && xp0->beat == xp1->beat
+             && xp0->tick == xp1->tick
+            ) {
+    rv = 0;
+  } else {
+    rv = 1;
+  }
+
+  if (rv != 0 || xp0->song_pos < 0
+      || xp0->beats_per_bar  != xp1->beats_per_bar
+      || xp0->ticks_per_beat != xp1->ticks_per_beat) {
+    /* one jack beat = one quarter note */
+    xp0->song_pos = mclk_song_pos(xp1->bar, xp1->beat, xp1->tick, xp1->beats_per_bar, xp1->ticks_per_beat);
+  }
+
+  xp0->valid  = xp1->valid;
+  xp0->bar    = xp1->bar;
+  xp0->beat   = xp1->beat;
+  xp0->tick   = xp1->tick;
   xp0->bar_start_tick = xp1->bar_start_tick;
+  xp0->beats_per_bar  = xp1->beats_per_bar;
+  xp0->ticks_per_beat = xp1->ticks_per_beat;
+  return rv;
 }
 
 /**
- * calculate song position (14 bit integer)
- * from current jack BBT info.
+ * song position from the current jack BBT info,
+ * as cached by update_pos().
  *
  * see "Song Position Pointer" at
  * http://www.midi.org/techspecs/midimessages.php
@@ -200,166 +1030,872 @@ static void remember_pos (struct bbtpos *xp0, jack_position_t *xp1) {
  * start/continue realtime messages, a 64 bit integer
  * is used to cover the full range of jack transport.
  */
-static const int64_t calc_song_pos(jack_position_t *xpos, int off) {
-  if (!(xpos->valid & JackPositionBBT)) return -1;
-
-  if (off < 0) {
-    /* auto offset */
-    if (xpos->bar == 1 && xpos->beat == 1 && xpos->tick == 0) off = 0;
-    else off = rintf(xpos->beats_per_minute * 4.0 * resync_delay / 60.0);
-  }
+static inline int64_t calc_song_pos(int off) {
+  if (last_xpos.song_pos < 0) return -1;
+  return off + last_xpos.song_pos;
+}
 
-  /* MIDI Beat Clock: 24 ticks per quarter note
-   * one MIDI-beat = six MIDI clocks
-   * -> 4 MIDI-beats per quarter note (jack beat)
-   * Note: jack counts bars and beats starting at 1
-   */
-  int64_t pos =
-    off
-    + 4 * ((xpos->bar - 1) * xpos->beats_per_bar + (xpos->beat - 1))
-    + floor(4.0 * xpos->tick / xpos->ticks_per_beat);
+/**
+ * MIDI beats between song position and 'continue' message
+ * for a transport locate to the given position.
+ */
+static int resync_offset(struct mclk_output *o, jack_position_t *xpos) {
+  const double delay = o->resync_delay >= 0 ? o->resync_delay : resync_delay;
+  if (xpos->bar == 1 && xpos->beat == 1 && xpos->tick == 0) return 0;
+  return rintf(xpos->beats_per_minute * SPP_PER_QN * delay / 60.0);
+}
 
-  return pos;
+/**
+ * reserve space for a MIDI message of the current cycle
+ * @param o output to send the message to
+ * @param time sample offset of event
+ * @param size message size
+ * @return buffer to write the message to, NULL if it cannot be queued
+ */
+static jack_midi_data_t *event_reserve(struct mclk_output *o, jack_nframes_t time, size_t size) {
+#ifdef HAVE_QUEUED_OUTPUTS
+  if (o->queue) {
+    return queue_reserve(o->queue, time, size);
+  }
+#endif
+  return jack_midi_event_reserve(o->buf, time, size);
 }
 
-static const int64_t send_pos_message(void* port_buf, jack_position_t *xpos, int off) {
-  if (msg_filter & MSG_NO_POSITION) return -1;
+/**
+ * send song position
+ * @param off MIDI beats ahead of current position, -1: auto (resync delay)
+ * @return song position (not wrapped), -1 if no position was sent
+ */
+static const int64_t send_pos_message(struct mclk_output *o, jack_position_t *xpos, int off) {
+  if (o->msg_filter & MSG_NO_POSITION) return -1;
   uint8_t *buffer;
-  const int64_t bcnt = calc_song_pos(xpos, off);
+  const int64_t bcnt = calc_song_pos(off < 0 ? resync_offset(o, xpos) : off);
+  int64_t spp = bcnt;
 
   /* send '0xf2' Song Position Pointer.
    * This is an internal 14 bit register that holds the number of
    * MIDI beats (1 beat = six MIDI clocks) since the start of the song.
    */
-  if (bcnt < 0 || bcnt >= 16384) {
+  if (bcnt < 0) {
     return -1;
   }
+  if (bcnt >= SPP_RANGE) {
+    if (!o->wrap_position) {
+      return -1;
+    }
+    spp = mclk_song_pos_wrap(bcnt, xpos->beats_per_bar);
+  }
 
-  buffer = jack_midi_event_reserve(port_buf, 0, 3);
+  buffer = event_reserve(o, 0, 3);
   if(!buffer) {
+    rt_stats.failed++;
     return -1;
   }
   buffer[0] = 0xf2;
-  buffer[1] = (bcnt)&0x7f; // LSB
-  buffer[2] = (bcnt>>7)&0x7f; // MSB
+  buffer[1] = (spp)&0x7f; // LSB
+  buffer[2] = (spp>>7)&0x7f; // MSB
   return bcnt;
 }
 
 /**
  * send 1 byte MIDI Message
- * @param port_buf buffer to write event to
+ * @param o output to send the message to
  * @param time sample offset of event
  * @param rt_msg message byte
  */
-static void send_rt_message(void* port_buf, jack_nframes_t time, uint8_t rt_msg) {
+static void send_rt_message(struct mclk_output *o, jack_nframes_t time, uint8_t rt_msg) {
   uint8_t *buffer;
-  buffer = jack_midi_event_reserve(port_buf, time, 1);
+  buffer = event_reserve(o, time, 1);
   if(buffer) {
     buffer[0] = rt_msg;
+  } else {
+    rt_stats.failed++;
   }
 }
 
 /**
- * jack process callback.
- * do the work: query jack-transport, send MIDI messages..
+ * pass accumulated statistics to the statistics thread.
+ * If the ringbuffer is full, statistics keep accumulating.
  */
-static int process (jack_nframes_t nframes, void *arg) {
+static void stats_push(void) {
+  if (!stats_rb || rt_stats.cycles == 0) {
+    return;
+  }
+  if (jack_ringbuffer_write_space(stats_rb) >= sizeof(struct mclk_stats)) {
+    jack_ringbuffer_write(stats_rb, (const char *) &rt_stats, sizeof(struct mclk_stats));
+    memset(&rt_stats, 0, sizeof(struct mclk_stats));
+  }
+}
+
+/**
+ * update effective message filter of all outputs
+ */
+static void update_msg_filter(void) {
+  int i;
+  for (i = 0; i < n_outputs; ++i) {
+    outputs[i].msg_filter = outputs[i].port_filter | msg_filter;
+  }
+}
+
+/**
+ * apply parameter updates from the control thread
+ */
+static void ctrl_drain(void) {
+  struct mclk_ctrl c;
+  if (!ctrl_rb) {
+    return;
+  }
+  while (jack_ringbuffer_read_space(ctrl_rb) >= sizeof(struct mclk_ctrl)) {
+    jack_ringbuffer_read(ctrl_rb, (char *) &c, sizeof(struct mclk_ctrl));
+    switch (c.param) {
+      case CTRL_BPM:
+	user_bpm = c.value;
+	break;
+      case CTRL_FORCE_BPM:
+	force_bpm = c.value ? 1 : 0;
+	break;
+      case CTRL_MSG_FILTER:
+	msg_filter = c.value;
+	update_msg_filter();
+	break;
+      case CTRL_JITTER:
+#ifdef WITH_JITTER
+	jitter_level = c.value;
+#endif
+	break;
+    }
+  }
+}
+
+/**
+ * reset tempo follower, the tempo is unknown until two events are received
+ */
+static void follow_reset(int ppqn) {
+  follow.ppqn = ppqn;
+  follow.sequence = 0;
+  follow.bpm = 0;
+}
+
+/**
+ * process one event of the tempo follower's input
+ * @param t time of the event [samples]
+ * @param ppqn 24 for MIDI clock, 1 for taps
+ * @param samplerate sample rate
+ */
+static void follow_event(int64_t t, int ppqn, double samplerate) {
+  if (ppqn != follow.ppqn) {
+    /* source changed */
+    follow_reset(ppqn);
+  }
+  if (follow.sequence == 1) {
+    follow.period = t - follow.prev;
+    init_dll(&follow.dll, t, follow.period, samplerate, follow_bandwidth);
+  }
+  else if (follow.sequence > 1) {
+    follow.period = samplerate * run_dll(&follow.dll, t, samplerate);
+  }
+  if (follow.sequence > 0 && follow.period > 0) {
+    follow.bpm = samplerate * 60.0 / (follow.period * ppqn);
+  }
+  follow.prev = t;
+  follow.sequence++;
+}
+
+/**
+ * read MIDI clock (0xf8) and taps (note-on) from the follower's input.
+ * The lock is lost if an event is overdue for twice the period,
+ * or 2 seconds before the tempo is known.
+ */
+static void follow_process(jack_nframes_t nframes, double samplerate) {
+  void *buf = jack_port_get_buffer(follow.port, nframes);
+  const uint32_t n_events = jack_midi_get_event_count(buf);
+  const jack_nframes_t last_frame = jack_last_frame_time(j_client);
+  double timeout;
+  uint32_t i;
+
+  /* 64bit time, jack_nframes_t wraps after a day */
+  follow.now += (jack_nframes_t) (last_frame - follow.last_frame);
+  follow.last_frame = last_frame;
+
+  for (i = 0; i < n_events; ++i) {
+    jack_midi_event_t ev;
+    jack_midi_event_get(&ev, buf, i);
+    if (ev.size == 1 && ev.buffer[0] == MIDI_RT_CLOCK) {
+      follow_event(follow.now + ev.time, MCLK_PPQN, samplerate);
+    }
+    else if (ev.size == 3 && (ev.buffer[0] & 0xf0) == 0x90 && ev.buffer[2] > 0) {
+      follow_event(follow.now + ev.time, 1, samplerate);
+    }
+  }
+
+  timeout = follow.sequence > 1 ? 2.0 * follow.period : 2.0 * samplerate;
+  if (follow.sequence > 0 && follow.now + nframes - follow.prev > timeout) {
+    follow_reset(follow.ppqn);
+  }
+}
+
+#define TP_UNITY 4294967296.0 /* 1.0 in 32.32 fixed point */
+
+/**
+ * clock tick interval in samples
+ */
+static double tp_interval(const tickphase *tp) {
+  return tp->interval / TP_UNITY;
+}
+
+/**
+ * exact position of tick k in constant tempo mode
+ * @param ip integer part [samples]
+ * @param fp fractional part [2^-32 samples]
+ */
+static void tp_fixed_pos(const tickphase *tp, int64_t k, int64_t *ip, uint32_t *fp) {
+  const uint64_t n  = tp->k_base + k;
+  const uint64_t lo = n * (tp->interval & 0xffffffff);
+  const uint64_t f  = (uint64_t) tp->origin_frac + (lo & 0xffffffff);
+  *ip = tp->origin + (int64_t)(n * (tp->interval >> 32) + (lo >> 32) + (f >> 32));
+  *fp = (uint32_t) f;
+}
+
+/**
+ * number of ticks from the start of the ramp to a given position
+ * @param u position relative to ramp_start
+ */
+static double ramp_ticks(const tickphase *tp, double u) {
+  if (u < 0) {
+    return u * tp->r0;
+  }
+  if (u < tp->ramp_len) {
+    return u * tp->r0 + u * u * (tp->r1 - tp->r0) / (2 * tp->ramp_len);
+  }
+  return tp->ramp_len * (tp->r0 + tp->r1) / 2 + (u - tp->ramp_len) * tp->r1;
+}
+
+/**
+ * inverse of ramp_ticks()
+ * @return position relative to ramp_start
+ */
+static double ramp_pos(const tickphase *tp, double g) {
+  const double g_end = tp->ramp_len * (tp->r0 + tp->r1) / 2;
+  if (g < 0) {
+    return g / tp->r0;
+  }
+  if (g < g_end) {
+    /* solve a u^2 + r0 u - g = 0, numerically stable for a -> 0 */
+    const double a = (tp->r1 - tp->r0) / (2 * tp->ramp_len);
+    return 2 * g / (tp->r0 + sqrt(tp->r0 * tp->r0 + 4 * a * g));
+  }
+  return tp->ramp_len + (g - g_end) / tp->r1;
+}
+
+/**
+ * make the anchor tick the new origin (k_base = 0), and end the ramp.
+ */
+static void tp_rebase(tickphase *tp) {
+  if (tp->ramp_len > 0) {
+    const double u = ramp_pos(tp, tp->g_anchor);
+    const double ip = floor(u);
+    tp->origin = tp->ramp_start + (int64_t) ip;
+    tp->origin_frac = (uint32_t) ((u - ip) * TP_UNITY);
+    tp->ramp_len = 0;
+  } else {
+    int64_t ip;
+    uint32_t fp;
+    tp_fixed_pos(tp, 0, &ip, &fp);
+    tp->origin = ip;
+    tp->origin_frac = fp;
+  }
+  tp->k_base = 0;
+}
+
+/**
+ * set tempo. Ticks up to the anchor keep their position.
+ */
+static void set_interval(tickphase *tp, double interval) {
+  const uint64_t fixed = llrint(interval * TP_UNITY);
+  if (fixed != tp->interval) {
+    tp_rebase(tp);
+    tp->interval = fixed;
+  }
+}
+
+/**
+ * set a linear tempo ramp, starting at the current tempo.
+ * @param tp tick phase
+ * @param start position where the ramp starts
+ * @param len length of the ramp
+ * @param interval tick interval at the end of the ramp and after
+ */
+static void set_ramp(tickphase *tp, int64_t start, double len, double interval) {
+  const double interval0 = tp_interval(tp);
+  tp_rebase(tp);
+  tp->interval = llrint(interval * TP_UNITY);
+  tp->ramp_start = start;
+  tp->ramp_len = len;
+  tp->r0 = 1.0 / interval0;
+  tp->r1 = 1.0 / interval;
+  tp->g_anchor = ramp_ticks(tp, (tp->origin - start) + tp->origin_frac / TP_UNITY);
+}
+
+/**
+ * position of clock tick k, rounded to the nearest sample
+ */
+static int64_t tick_pos(const tickphase *tp, int64_t k) {
+  if (tp->ramp_len <= 0) {
+    int64_t ip;
+    uint32_t fp;
+    tp_fixed_pos(tp, k, &ip, &fp);
+    return ip + (fp >= 0x80000000u ? 1 : 0);
+  }
+  return tp->ramp_start + llrint(ramp_pos(tp, tp->g_anchor + k));
+}
+
+/**
+ * find the first clock tick at or after a given position.
+ * @param tp tick phase
+ * @param pos position to look for (in samples, same timebase as the origin)
+ * @return smallest k >= 1 such that tick_pos(k) >= pos
+ */
+static int64_t tick_index(const tickphase *tp, int64_t pos) {
+  int64_t k;
+  if (tp->ramp_len <= 0) {
+    const double u = (pos - tp->origin) - .5 - tp->origin_frac / TP_UNITY;
+    k = ceil(u / tp_interval(tp)) - tp->k_base;
+  } else {
+    k = ceil(ramp_ticks(tp, (pos - tp->ramp_start) - .5) - tp->g_anchor);
+  }
+  if (k < 1) k = 1;
+  /* compensate for rounding of the estimate, this iterates at most once */
+  while (k > 1 && tick_pos(tp, k - 1) >= pos) --k;
+  while (tick_pos(tp, k) < pos) ++k;
+  return k;
+}
+
+/**
+ * move the anchor forward by n ticks
+ */
+static void advance_anchor(tickphase *tp, int64_t n) {
+  if (tp->ramp_len <= 0) {
+    tp->k_base += n;
+    if (tp->k_base >= TP_MAX_K_BASE) {
+      tp_rebase(tp);
+    }
+    return;
+  }
+  tp->g_anchor += n;
+  if (ramp_pos(tp, tp->g_anchor) >= tp->ramp_len) {
+    /* ramp is complete, continue at constant tempo */
+    tp_rebase(tp);
+  }
+}
+
+/**
+ * extend the look-ahead schedule to cover the given position.
+ * The schedule is rebuilt if the tickphase changed, and refilled
+ * with sched_cycles cycles worth of ticks when it runs out.
+ * @param pos last position that needs to be covered
+ * @param nframes cycle length
+ */
+static void sched_update(const tickphase *tp, int64_t pos, jack_nframes_t nframes) {
+  tickschedule *s = &mclk_sched;
+  const int64_t n_first = tp->k_base + 1;
+  int64_t until;
+
+  if (sched_cycles <= 0 || tp->ramp_len > 0) {
+    s->len = 0;
+    return;
+  }
+  if (s->len == 0 || s->n0 > n_first || s->origin != tp->origin || s->origin_frac != tp->origin_frac || s->interval != tp->interval) {
+    s->origin = tp->origin;
+    s->origin_frac = tp->origin_frac;
+    s->interval = tp->interval;
+    s->n0 = n_first;
+    s->len = 0;
+  } else if (s->n0 < n_first) {
+    /* drop ticks before the anchor */
+    const int64_t n = n_first - s->n0 < s->len ? n_first - s->n0 : s->len;
+    s->n0 += n;
+    s->len -= n;
+    if (s->len == 0) {
+      s->n0 = n_first;
+    }
+  }
+  if (s->len > 0 && s->pos[(s->n0 + s->len - 1) & (SCHED_SIZE - 1)] >= pos) {
+    return;
+  }
+
+  until = pos + (int64_t) sched_cycles * nframes;
+  while (s->len < SCHED_SIZE) {
+    const int64_t n = s->n0 + s->len;
+    const int64_t p = tick_pos(tp, n - tp->k_base);
+    s->pos[n & (SCHED_SIZE - 1)] = p;
+    ++s->len;
+    if (p >= until) {
+      break;
+    }
+  }
+}
+
+/**
+ * position of clock tick k, same as tick_pos(), from the schedule if possible.
+ * sched_update() must have been called after the last change of the tickphase.
+ */
+static inline int64_t sched_pos(const tickphase *tp, int64_t k) {
+  const tickschedule *s = &mclk_sched;
+  const int64_t i = tp->k_base + k - s->n0;
+  if (i >= 0 && i < s->len) {
+    return s->pos[(s->n0 + i) & (SCHED_SIZE - 1)];
+  }
+  return tick_pos(tp, k);
+}
+
+/**
+ * first clock tick at or after a given position, same as tick_index(),
+ * from the schedule if possible
+ */
+static int64_t sched_index(const tickphase *tp, int64_t pos) {
+  const tickschedule *s = &mclk_sched;
+  int64_t lo, hi;
+  if (s->len == 0 || s->n0 != tp->k_base + 1 || s->pos[(s->n0 + s->len - 1) & (SCHED_SIZE - 1)] < pos) {
+    return tick_index(tp, pos);
+  }
+  /* binary search for the first tick >= pos, the first entry is k = 1 */
+  lo = 0;
+  hi = s->len - 1;
+  while (lo < hi) {
+    const int64_t mid = (lo + hi) / 2;
+    if (s->pos[(s->n0 + mid) & (SCHED_SIZE - 1)] >= pos) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo + 1;
+}
+
+/**
+ * effective clock offset of an output,
+ * including playback latency compensation.
+ */
+static inline int32_t output_offset(const struct mclk_output *o) {
+  if (compensate_latency) {
+    return o->offset - (int32_t) o->latency;
+  }
+  return o->offset;
+}
+
+/**
+ * send start/stop/continue and song-position messages
+ * to a given output after a transport state change.
+ * @param o output to send messages to
+ * @param xstate new transport state
+ * @param xpos current transport position
+ */
+static void send_transport_messages(struct mclk_output *o, jack_transport_state_t xstate, jack_position_t *xpos) {
+  const short msg_filter = o->msg_filter;
+  /* initial beat tick and transport messages are delayed along with the clock */
+  const int32_t offset = output_offset(o);
+  const jack_nframes_t delay = offset > 0 ? offset : 0;
+
+  switch(xstate) {
+    case JackTransportStopped:
+      if (!(msg_filter & MSG_NO_TRANSPORT)) {
+	send_rt_message(o, 0, MIDI_RT_STOP);
+      }
+      o->song_position_sync = send_pos_message(o, xpos, -1);
+      break;
+    case JackTransportRolling:
+      /* handle transport locate while rolling.
+       * jack transport state changes  Rolling -> Starting -> Rolling
+       */
+      if(m_xstate == JackTransportStarting && !(msg_filter & MSG_NO_POSITION)) {
+	if (o->song_position_sync < 0) {
+	  /* send stop IFF not stopped, yet */
+	  send_rt_message(o, 0, MIDI_RT_STOP);
+	}
+	if (o->song_position_sync != 0) {
+	  /* re-set 'continue' message sync point */
+	  if ((o->song_position_sync = send_pos_message(o, xpos, -1)) < 0) {
+	    if (!(msg_filter & MSG_NO_TRANSPORT)) {
+	      send_rt_message(o, delay, MIDI_RT_CONTINUE);
+	    }
+	  }
+	} else {
+	  /* 'start' at 0, don't queue 'continue' message */
+	  o->song_position_sync = -1;
+	}
+	break;
+      }
+    case JackTransportStarting:
+      if(m_xstate == JackTransportStarting) {
+	break;
+      }
+      if( xpos->frame == 0 ) {
+	if (!(msg_filter & MSG_NO_TRANSPORT)) {
+	  send_rt_message(o, delay, MIDI_RT_START);
+	  o->song_position_sync = 0;
+	}
+      } else {
+	/* only send continue message here if song-position
+	 * is not used .
+	 * w/song-pos it queued just-in-time
+	 */
+	if (!(msg_filter & MSG_NO_TRANSPORT) && (msg_filter & MSG_NO_POSITION)) {
+	  send_rt_message(o, delay, MIDI_RT_CONTINUE);
+	}
+      }
+      break;
+    default:
+      break;
+  }
+
+  /* initial beat tick */
+  o->tick_count = 0;
+  if (xstate == JackTransportRolling
+      && ((xpos->frame == 0) || (msg_filter & MSG_NO_POSITION))
+     ) {
+    send_rt_message(o, delay, MIDI_RT_CLOCK);
+    o->tick_count = 1 % o->tick_period;
+    /* sent at its nominal position, no deviation */
+    o->cycle_clocks = 1;
+    rt_stats.ticks++;
+    if (rt_stats.max_ticks < 1) {
+      rt_stats.max_ticks = 1;
+    }
+  }
+}
+
+/**
+ * MTC frame containing a given position
+ * @param pos transport position [samples]
+ */
+static int64_t mtc_frame(enum MtcRate rate, int64_t pos, jack_nframes_t sample_rate) {
+  if (pos <= 0) return 0;
+  return pos * mtc_rates[rate].num / ((int64_t) sample_rate * mtc_rates[rate].den);
+}
+
+/**
+ * index of the first MTC quarter frame at or after a given position
+ * @param pos transport position [samples]
+ */
+static int64_t mtc_qf_index(enum MtcRate rate, int64_t pos, jack_nframes_t sample_rate) {
+  const int64_t d = (int64_t) sample_rate * mtc_rates[rate].den;
+  if (pos <= 0) return 0;
+  return (pos * 4 * mtc_rates[rate].num + d - 1) / d;
+}
+
+/**
+ * transport position of a MTC quarter frame [samples]
+ */
+static int64_t mtc_qf_pos(enum MtcRate rate, int64_t q, jack_nframes_t sample_rate) {
+  return q * sample_rate * mtc_rates[rate].den / (4 * mtc_rates[rate].num);
+}
+
+/**
+ * convert frame count to hour, minute, second, frame
+ * @param f frames since transport position 0
+ */
+static void mtc_time(enum MtcRate rate, int64_t f, uint8_t tc[4]) {
+  const int fps = mtc_rates[rate].fps;
+  if (rate == MTC_29_97DF) {
+    /* frame numbers 0 and 1 are skipped every minute, except every 10th */
+    const int64_t d = f / 17982;
+    const int64_t m = f % 17982;
+    f += 18 * d + 2 * ((m - 2) / 1798);
+  }
+  tc[0] = (f / (fps * 3600)) % 24;
+  tc[1] = (f / (fps * 60)) % 60;
+  tc[2] = (f / fps) % 60;
+  tc[3] = f % fps;
+}
+
+/**
+ * send MTC full frame message (universal realtime sysex)
+ * @param time sample offset of event
+ * @param pos transport position [samples]
+ */
+static void send_mtc_full_frame(struct mclk_output *o, jack_nframes_t time, int64_t pos, jack_nframes_t sample_rate) {
+  uint8_t tc[4];
+  uint8_t *buffer;
+  mtc_time(o->mtc_rate, mtc_frame(o->mtc_rate, pos, sample_rate), tc);
+
+  buffer = event_reserve(o, time, 10);
+  if(!buffer) {
+    rt_stats.failed++;
+    return;
+  }
+  buffer[0] = 0xf0;
+  buffer[1] = 0x7f; // realtime
+  buffer[2] = 0x7f; // all devices
+  buffer[3] = 0x01; // MTC
+  buffer[4] = 0x01; // full frame
+  buffer[5] = (o->mtc_rate << 5) | tc[0];
+  buffer[6] = tc[1];
+  buffer[7] = tc[2];
+  buffer[8] = tc[3];
+  buffer[9] = 0xf7;
+}
+
+/**
+ * prepare MTC quarter frames for the current cycle of a given output,
+ * and send a full frame message after a transport locate or state change.
+ *
+ * Quarter frames are placed relative to the transport position and
+ * sent by mtc_send() in the order of time along with the clock ticks.
+ * The 8 quarter frames of a time code start at every other frame and
+ * contain the time of that frame.
+ *
+ * @param o output to send MTC to
+ * @param xpos current transport position
+ * @param nframes cycle length
+ * @param rolling 1 if transport is rolling
+ * @param located 1 if transport was located or its state changed
+ */
+static void mtc_prepare(struct mclk_output *o, jack_position_t *xpos, jack_nframes_t nframes, int rolling, int located) {
+  /* time code is delayed along with the clock */
+  const int32_t offset = output_offset(o);
+  const jack_nframes_t delay = offset > 0 ? offset : 0;
+  const int64_t start = (int64_t) xpos->frame - offset;
+  int64_t q;
+
+  o->mtc_start = start;
+  if (located) {
+    send_mtc_full_frame(o, delay, start + delay, xpos->frame_rate);
+  }
+  if (!rolling) {
+    o->mtc_next_q = o->mtc_end_q = 0;
+    return;
+  }
+
+  if (located) {
+    /* not before start/stop/continue messages */
+    q = mtc_qf_index(o->mtc_rate, start + delay, xpos->frame_rate);
+  } else {
+    q = mtc_qf_index(o->mtc_rate, start, xpos->frame_rate);
+    if (q < o->mtc_next_q) {
+      q = o->mtc_next_q;
+    }
+  }
+  o->mtc_next_q = q;
+  o->mtc_end_q = mtc_qf_index(o->mtc_rate, start + nframes, xpos->frame_rate);
+}
+
+/**
+ * send pending MTC quarter frames of the current cycle
+ * @param o output to send MTC to
+ * @param limit only send quarter frames before this sample offset
+ * @param sample_rate sample rate
+ */
+static void mtc_send(struct mclk_output *o, jack_nframes_t limit, jack_nframes_t sample_rate) {
+  const enum MtcRate rate = o->mtc_rate;
+  while (o->mtc_next_q < o->mtc_end_q) {
+    const int64_t q = o->mtc_next_q;
+    const int64_t t = mtc_qf_pos(rate, q, sample_rate) - o->mtc_start;
+    const int piece = q & 7;
+    uint8_t tc[4];
+    uint8_t *buffer;
+    uint8_t nibble;
+
+    if (t >= limit) {
+      break;
+    }
+    o->mtc_next_q++;
+
+    mtc_time(rate, (q >> 3) * 2, tc);
+    switch (piece) {
+      case 0: nibble = tc[3] & 0xf; break;
+      case 1: nibble = tc[3] >> 4; break;
+      case 2: nibble = tc[2] & 0xf; break;
+      case 3: nibble = tc[2] >> 4; break;
+      case 4: nibble = tc[1] & 0xf; break;
+      case 5: nibble = tc[1] >> 4; break;
+      case 6: nibble = tc[0] & 0xf; break;
+      default: nibble = (rate << 1) | (tc[0] >> 4); break;
+    }
+
+    buffer = event_reserve(o, t > 0 ? t : 0, 2);
+    if(!buffer) {
+      rt_stats.failed++;
+      continue;
+    }
+    buffer[0] = 0xf1;
+    buffer[1] = (piece << 4) | nibble;
+  }
+}
+
+/**
+ * send clock ticks for the current cycle to a given output.
+ *
+ * Every output keeps the index of the next tick to send, so all ticks
+ * are sent exactly once, even if the tick positions change between
+ * cycles (tempo change). Ticks that are late by more than one interval
+ * are skipped.
+ *
+ * @param o output to send clock to
+ * @param xpos current transport position
+ * @param cycle_start position corresponding to the first sample of the cycle
+ * @param nframes cycle length
+ */
+static void send_clock_ticks(struct mclk_output *o, jack_position_t *xpos, int64_t cycle_start, jack_nframes_t nframes) {
+  const short msg_filter = o->msg_filter;
+  const int32_t offset = output_offset(o);
+  const double clock_tick_interval = tp_interval(&mclk_phase);
+  int ticks_sent_this_cycle = 0;
+  uint32_t clocks = 0;
+  int64_t k;
+
+  sched_update(&mclk_phase, cycle_start + nframes - offset, nframes);
+
+  const int64_t k_late  = sched_index(&mclk_phase, cycle_start - offset - llrint(clock_tick_interval));
+  const int64_t k_end   = sched_index(&mclk_phase, cycle_start + nframes - offset);
+  const int64_t sync    = calc_song_pos(0);
+  int64_t k_first = o->next_k;
+
+  if (k_first < k_late) {
+    rt_stats.skipped += k_late - k_first;
+    k_first = k_late;
+  }
+  if (k_first < k_end) {
+    o->next_k = k_end;
+  }
+
+  for (k = k_first; k < k_end; ++k) {
+    const int64_t nominal_offset = sched_pos(&mclk_phase, k) - cycle_start + offset;
+    int64_t next_tick_offset = nominal_offset;
+
+#ifdef WITH_JITTER
+    if (jitter_level > 0) {
+      next_tick_offset += llrint(jitter_table[jitter_idx++ & (JITTER_TABLE_SIZE - 1)] * jitter_level * clock_tick_interval);
+    }
+#endif
+    /* ticks ahead of time can only be sent right away */
+    if (next_tick_offset < 0) next_tick_offset = 0;
+    if (next_tick_offset >= nframes) next_tick_offset = nframes - 1;
+
+    const uint32_t dev = llabs(next_tick_offset - nominal_offset);
+    if (dev > rt_stats.max_dev) {
+      rt_stats.max_dev = dev;
+    }
+
+    if (o->mtc_rate != MTC_NONE) {
+      mtc_send(o, next_tick_offset, xpos->frame_rate);
+    }
+
+    if (o->song_position_sync > 0 && !(msg_filter & MSG_NO_POSITION)) {
+      /* send 'continue' realtime message on time,
+       * 4 MIDI-beats per quarter note (jack beat) */
+      if (sync + ticks_sent_this_cycle * MCLK_PPQN / phase_ppqn / 4 >= o->song_position_sync) {
+	if (!(msg_filter & MSG_NO_TRANSPORT)) {
+	  send_rt_message(o, next_tick_offset, MIDI_RT_CONTINUE);
+	}
+	o->song_position_sync = -1;
+	o->tick_count = 0;
+      }
+    }
+
+    /* enqueue clock tick */
+    if (o->tick_count == 0) {
+      send_rt_message(o, next_tick_offset, MIDI_RT_CLOCK);
+      clocks++;
+    }
+    if (++o->tick_count >= o->tick_period) {
+      o->tick_count = 0;
+    }
+    ticks_sent_this_cycle++;
+  }
+
+  rt_stats.ticks += clocks;
+  clocks += o->cycle_clocks;
+  if (clocks > rt_stats.max_ticks) {
+    rt_stats.max_ticks = clocks;
+  }
+}
+
+/**
+ * generate MIDI messages for the current cycle:
+ * query jack-transport, send MIDI messages..
+ */
+static void process_clock (jack_nframes_t nframes) {
   jack_position_t xpos;
   double samples_per_beat;
   jack_nframes_t bbt_offset = 0;
-  int ticks_sent_this_cycle = 0;
+  int located = 0;
+  int i;
+
+  /* publish statistics of previous cycles */
+  stats_push();
+  rt_stats.cycles++;
+
+  /* apply runtime parameter changes */
+  ctrl_drain();
 
   /* query jack transport state */
   jack_transport_state_t xstate = jack_transport_query(j_client, &xpos);
-  void* port_buf = jack_port_get_buffer(mclk_output_port, nframes);
+  rt_stats.xstate = xstate;
+
+  /* tempo of external clock */
+  double fallback_bpm = user_bpm;
+  if (follow.port) {
+    follow_process(nframes, xpos.frame_rate);
+    if (follow.bpm > 0) {
+      fallback_bpm = follow.bpm;
+    }
+  }
 
-  /* prepare MIDI buffer */
-  jack_midi_clear_buffer(port_buf);
+  /* prepare MIDI buffers */
+  for (i = 0; i < n_outputs; ++i) {
+    outputs[i].cycle_clocks = 0;
+#ifdef HAVE_QUEUED_OUTPUTS
+    if (outputs[i].queue) {
+      outputs[i].queue->n_pending = 0;
+      continue;
+    }
+#endif
+    outputs[i].buf = jack_port_get_buffer(outputs[i].port, nframes);
+    jack_midi_clear_buffer(outputs[i].buf);
+  }
 
   if (client_state != Run) {
-    return 0;
+    return;
   }
 
   /* send position updates if stopped and located */
-  if (xstate == JackTransportStopped && xstate == m_xstate) {
-    if (pos_changed(&last_xpos, &xpos) > 0) {
-      song_position_sync = send_pos_message(port_buf, &xpos, -1);
+  if (update_pos(&last_xpos, &xpos) > 0 && xstate == JackTransportStopped && xstate == m_xstate) {
+    for (i = 0; i < n_outputs; ++i) {
+      outputs[i].song_position_sync = send_pos_message(&outputs[i], &xpos, -1);
     }
   }
-  remember_pos(&last_xpos, &xpos);
 
   /* send RT messages start/stop/continue if transport state changed */
   if( xstate != m_xstate ) {
-    switch(xstate) {
-      case JackTransportStopped:
-	if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	  send_rt_message(port_buf, 0, MIDI_RT_STOP);
-	}
-	song_position_sync = send_pos_message(port_buf, &xpos, -1);
-	break;
-      case JackTransportRolling:
-	/* handle transport locate while rolling.
-	 * jack transport state changes  Rolling -> Starting -> Rolling
-	 */
-	if(m_xstate == JackTransportStarting && !(msg_filter & MSG_NO_POSITION)) {
-	  if (song_position_sync < 0) {
-	    /* send stop IFF not stopped, yet */
-	    send_rt_message(port_buf, 0, MIDI_RT_STOP);
-	  }
-	  if (song_position_sync != 0) {
-	    /* re-set 'continue' message sync point */
-	    if ((song_position_sync = send_pos_message(port_buf, &xpos, -1)) < 0) {
-	      if (!(msg_filter & MSG_NO_TRANSPORT)) {
-		send_rt_message(port_buf, 0, MIDI_RT_CONTINUE);
-	      }
-	    }
-	  } else {
-	    /* 'start' at 0, don't queue 'continue' message */
-	    song_position_sync = -1;
-	  }
-	  break;
-	}
-      case JackTransportStarting:
-	if(m_xstate == JackTransportStarting) {
-	  break;
-	}
-	if( xpos.frame == 0 ) {
-	  if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	    send_rt_message(port_buf, 0, MIDI_RT_START);
-	    song_position_sync = 0;
-	  }
-	} else {
-	  /* only send continue message here if song-position
-	   * is not used .
-	   * w/song-pos it queued just-in-time
-	   */
-	  if (!(msg_filter & MSG_NO_TRANSPORT) && (msg_filter & MSG_NO_POSITION)) {
-	    send_rt_message(port_buf, 0, MIDI_RT_CONTINUE);
-	  }
-	}
-	break;
-      default:
-	break;
+    for (i = 0; i < n_outputs; ++i) {
+      send_transport_messages(&outputs[i], xstate, &xpos);
     }
+    memset(&mclk_phase, 0, sizeof(tickphase));
+    mclk_phase.origin = xpos.frame;
+    prev_interval = 0;
+    next_cycle_start = -1;
+    m_xstate = xstate;
+    located = 1;
+  }
 
-    /* initial beat tick */
-    if (xstate == JackTransportRolling
-	&& ((xpos.frame == 0) || (msg_filter & MSG_NO_POSITION))
-	) {
-      send_rt_message(port_buf, 0, MIDI_RT_CLOCK);
+  /* MIDI Time Code, does not depend on tempo */
+  if (xpos.frame != next_mtc_start) {
+    located = 1;
+  }
+  for (i = 0; i < n_outputs; ++i) {
+    if (outputs[i].mtc_rate != MTC_NONE) {
+      mtc_prepare(&outputs[i], &xpos, nframes, xstate == JackTransportRolling, located);
     }
-
-    mclk_last_tick = xpos.frame;
-    m_xstate = xstate;
   }
+  next_mtc_start = xpos.frame + (xstate == JackTransportRolling ? nframes : 0);
 
   if((xstate != JackTransportRolling)) {
-    return 0;
+    return;
   }
 
   /* calculate clock tick interval */
-  if(force_bpm && user_bpm > 0) {
-    samples_per_beat = (double) xpos.frame_rate * 60.0 / user_bpm;
+  if(force_bpm && fallback_bpm > 0) {
+    samples_per_beat = (double) xpos.frame_rate * 60.0 / fallback_bpm;
   }
   else if(xpos.valid & JackPositionBBT) {
     samples_per_beat = (double) xpos.frame_rate * 60.0 / xpos.beats_per_minute;
@@ -367,68 +1903,82 @@ static int process (jack_nframes_t nframes, void *arg) {
       bbt_offset = xpos.bbt_offset;
     }
   }
-  else if(user_bpm > 0) {
-    samples_per_beat = (double) xpos.frame_rate * 60.0 / user_bpm;
+  else if(fallback_bpm > 0) {
+    samples_per_beat = (double) xpos.frame_rate * 60.0 / fallback_bpm;
   } else {
-    return 0; /* no tempo known */
-  }
-
-  /* It is an industry convention that tempo, while reported as "beats
-   * per minute" is actually "quarter notes per minute" in many DAW's.
-   * However, some DAW's/musicians actually use beats per minute
-   * (using the definition of "beat" as the denomitor of the time
-   * signature). While it appears that the JACK transport's intent
-   * is the latter, it's totally up to the DAW to define the tempo/note
-   * relationship. Currently Ardour does "quarter notes per minute."
-   *
-   * Viz. https://community.ardour.org/node/1433
-   *      http://www.steinberg.net/forums/viewtopic.php?t=56065
-   */
-  const double quarter_notes_per_beat = (tempo_is_qnpm) ? 1.0 : (xpos.beat_type / 4.0);
+    goto out; /* no tempo known */
+  }
 
-  /* MIDI Beat Clock: Send 24 ticks per quarter note  */
-  const double samples_per_quarter_note = samples_per_beat / quarter_notes_per_beat;
-  const double clock_tick_interval = samples_per_quarter_note / 24.0;
+  /* MIDI Beat Clock: Send 24 ticks per quarter note,
+   * outputs with a different ppqn use a subset of phase_ppqn */
+  const double quarter_notes_per_beat = mclk_quarter_notes_per_beat(tempo_is_qnpm, xpos.beat_type);
+  const double clock_tick_interval = mclk_tick_interval(samples_per_beat, quarter_notes_per_beat, phase_ppqn);
 
+  if (!isfinite(clock_tick_interval) || clock_tick_interval < 1.0) {
+    goto out; /* invalid tempo */
+  }
 
-  /* send clock ticks for this cycle */
-  while(1) {
-#ifdef WITH_JITTER
-    const double next_tick = mclk_last_tick + clock_tick_interval + jitter_rand;
-#else
-    const double next_tick = mclk_last_tick + clock_tick_interval;
-#endif
-    const int64_t next_tick_offset = llrint(next_tick) - xpos.frame - bbt_offset;
-    if (next_tick_offset >= nframes) break;
+  const int64_t cycle_start = (int64_t) xpos.frame + bbt_offset;
+  int64_t min_k = INT64_MAX;
 
-    if (next_tick_offset >= 0) {
+  /* set tick positions for this cycle */
+  if (interpolate_tempo && prev_interval > 0 && prev_interval != clock_tick_interval && cycle_start == next_cycle_start) {
+    /* ramp from previous to current tempo during this cycle */
+    set_ramp(&mclk_phase, cycle_start, nframes, clock_tick_interval);
+  } else {
+    set_interval(&mclk_phase, clock_tick_interval);
+  }
+  prev_interval = clock_tick_interval;
 
-      if (song_position_sync > 0 && !(msg_filter & MSG_NO_POSITION)) {
-	/* send 'continue' realtime message on time */
-	const int64_t sync = calc_song_pos(&xpos, 0);
-	/* 4 MIDI-beats per quarter note (jack beat) */
-	if (sync + ticks_sent_this_cycle / 4 >= song_position_sync) {
-	  if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	    send_rt_message(port_buf, next_tick_offset, MIDI_RT_CONTINUE);
-	  }
-	  song_position_sync = -1;
-	}
-      }
+  /* transport started, or jumped without state change */
+  if (cycle_start != next_cycle_start) {
+    const int64_t k = tick_index(&mclk_phase, cycle_start);
+    for (i = 0; i < n_outputs; ++i) {
+      outputs[i].next_k = k;
+    }
+    if (k > 1) {
+      /* clock ticks that were not sent due to a transport jump */
+      rt_stats.catchup++;
+      rt_stats.skipped += k - 1;
+    }
+  }
+  next_cycle_start = cycle_start + nframes;
+  rt_stats.rolling++;
+  rt_stats.bpm = 60.0 * xpos.frame_rate / samples_per_beat;
 
-      /* enqueue clock tick */
-      send_rt_message(port_buf, next_tick_offset, MIDI_RT_CLOCK);
+  /* send clock ticks for this cycle */
+  for (i = 0; i < n_outputs; ++i) {
+    send_clock_ticks(&outputs[i], &xpos, cycle_start, nframes);
+    if (outputs[i].next_k < min_k) {
+      min_k = outputs[i].next_k;
     }
+  }
 
-#ifdef WITH_JITTER
-    if (jitter_level > 0) {
-	    jitter_rand = randf() * jitter_level * clock_tick_interval;
+  /* re-anchor at the last tick that was sent by all outputs */
+  if (min_k > 1 && min_k != INT64_MAX) {
+    advance_anchor(&mclk_phase, min_k - 1);
+    for (i = 0; i < n_outputs; ++i) {
+      outputs[i].next_k -= min_k - 1;
     }
-#endif
+  }
 
-    mclk_last_tick = next_tick;
-    ticks_sent_this_cycle++;
+out:
+  /* send remaining MTC quarter frames of this cycle */
+  for (i = 0; i < n_outputs; ++i) {
+    if (outputs[i].mtc_rate != MTC_NONE) {
+      mtc_send(&outputs[i], nframes, xpos.frame_rate);
+    }
   }
+}
 
+/**
+ * jack process callback.
+ */
+static int process (jack_nframes_t nframes, void *arg) {
+  process_clock(nframes);
+#ifdef HAVE_QUEUED_OUTPUTS
+  queue_flush(nframes);
+#endif
   return 0;
 }
 
@@ -442,6 +1992,13 @@ static void jack_shutdown (void *arg) {
   wake_main_now();
 }
 
+/**
+ * called by JACK in the process thread before the first cycle
+ */
+static void rt_thread_init(void *arg) {
+  mclk_mem_lock_stack();
+}
+
 /**
  * open a client connection to the JACK server
  */
@@ -464,6 +2021,7 @@ static int init_jack(const char *client_name) {
   }
 
   jack_set_process_callback (j_client, process, 0);
+  jack_set_thread_init_callback (j_client, rt_thread_init, NULL);
 #ifndef WIN32
   jack_on_shutdown (j_client, jack_shutdown, NULL);
 #endif
@@ -472,47 +2030,164 @@ static int init_jack(const char *client_name) {
 }
 #endif // JACK_INTERNAL_CLIENT
 
+/**
+ * jack latency callback.
+ * remember the playback latency of every output port,
+ * process() uses it to send the clock ahead of time.
+ */
+static void latency_cb (jack_latency_callback_mode_t mode, void *arg) {
+  int i;
+  if (mode != JackPlaybackLatency) {
+    return;
+  }
+  for (i = 0; i < n_outputs; ++i) {
+    jack_latency_range_t r;
+    if (!outputs[i].port) {
+      continue;
+    }
+    jack_port_get_latency_range(outputs[i].port, JackPlaybackLatency, &r);
+    outputs[i].latency = r.max;
+  }
+}
+
+/**
+ * add an output port with default settings
+ * @param name port name
+ * @return output or NULL if the maximum number of outputs is reached
+ */
+static struct mclk_output *add_output(const char *name) {
+  struct mclk_output *o;
+  if (n_outputs >= MAX_OUTPUTS) {
+    fprintf (stderr, "too many outputs, at most %d are supported.\n", MAX_OUTPUTS);
+    return NULL;
+  }
+  o = &outputs[n_outputs++];
+  memset(o, 0, sizeof(struct mclk_output));
+  o->name = name;
+  o->ppqn = MCLK_PPQN;
+  o->divider = 1;
+  o->resync_delay = -1;
+  o->song_position_sync = -1;
+  o->mtc_rate = MTC_NONE;
+  return o;
+}
+
+/**
+ * greatest common divisor
+ */
+static int gcd(int a, int b) {
+  while (b) {
+    const int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
 static int jack_portsetup(void) {
-  if ((mclk_output_port = jack_port_register(j_client, "mclk_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
-    fprintf (stderr, "cannot register mclk output port !\n");
+  int i;
+  if (n_outputs == 0 && !add_output("mclk_out")) {
+    return (-1);
+  }
+#ifdef HAVE_QUEUED_OUTPUTS
+  if (queue_init()) {
     return (-1);
   }
+#endif
+  /* one phase for all outputs: least common multiple of their ppqn */
+  phase_ppqn = 1;
+  for (i = 0; i < n_outputs; ++i) {
+    phase_ppqn = phase_ppqn / gcd(phase_ppqn, outputs[i].ppqn) * outputs[i].ppqn;
+    if (phase_ppqn > MAX_PHASE_PPQN) {
+      fprintf (stderr, "cannot combine the ppqn of all outputs, their least common multiple exceeds %d.\n", MAX_PHASE_PPQN);
+      goto fail;
+    }
+  }
+  for (i = 0; i < n_outputs; ++i) {
+    struct mclk_output *o = &outputs[i];
+    o->tick_period = phase_ppqn / o->ppqn * o->divider;
+#ifdef HAVE_QUEUED_OUTPUTS
+    if (o->rawmidi || o->net) {
+      if (queue_open(o)) {
+	goto fail;
+      }
+      continue;
+    }
+#endif
+    if ((o->port = jack_port_register(j_client, o->name, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk output port '%s' !\n", o->name);
+      goto fail;
+    }
+  }
+  if (follow_tempo) {
+    follow_reset(MCLK_PPQN);
+    follow.last_frame = jack_last_frame_time(j_client);
+    if ((follow.port = jack_port_register(j_client, "mclk_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk input port !\n");
+      goto fail;
+    }
+  }
+  update_msg_filter();
+  if (compensate_latency) {
+    jack_set_latency_callback (j_client, latency_cb, NULL);
+  }
   return (0);
+
+fail:
+#ifdef HAVE_QUEUED_OUTPUTS
+  /* close the outputs that were opened */
+  queue_stop();
+#endif
+  return (-1);
 }
 
-#ifndef JACK_INTERNAL_CLIENT
-static void port_connect(char *mclk_port) {
-  if (mclk_port && jack_connect(j_client, jack_port_name(mclk_output_port), mclk_port)) {
-    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(mclk_output_port), mclk_port);
+static void port_connect(struct mclk_output *o, const char *mclk_port) {
+  if (mclk_port && !o->port) {
+    fprintf(stderr, "cannot connect output %s to %s, it is not a JACK port\n", o->name, mclk_port);
+    return;
+  }
+  if (mclk_port && jack_connect(j_client, jack_port_name(o->port), mclk_port)) {
+    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(o->port), mclk_port);
   }
 }
 
-static void catchsig (int sig) {
-#ifndef _WIN32
-  signal(SIGHUP, catchsig);
-#endif
-  client_state = Exit;
-  wake_main_now();
+static void follow_connect(void) {
+  if (follow.port && follow.connect && *follow.connect
+      && jack_connect(j_client, follow.connect, jack_port_name(follow.port))) {
+    fprintf(stderr, "cannot connect port %s to %s\n", follow.connect, jack_port_name(follow.port));
+  }
 }
 
 /**************************
- * main application code
+ * commandline options
  */
 
 static struct option const long_options[] =
 {
   {"bpm", required_argument, 0, 'b'},
   {"force-bpm", no_argument, 0, 'B'},
+  {"follow", required_argument, 0, 'f'},
+  {"control", required_argument, 0, 'C'},
   {"resync-delay", required_argument, 0, 'd'},
+  {"stats", required_argument, 0, 'S'},
+  {"stats-file", required_argument, 0, 'F'},
+  {"shm", required_argument, 0, 'E'},
   {"jitter-level", required_argument, 0, 'J'},
+  {"jitter-profile", required_argument, 0, 'j'},
+  {"latency", no_argument, 0, 'L'},
+  {"lookahead", required_argument, 0, 'l'},
   {"help", no_argument, 0, 'h'},
+  {"interpolate", no_argument, 0, 'i'},
+  {"no-mlockall", no_argument, 0, 'U'},
   {"no-position", no_argument, 0, 'P'},
   {"no-transport", no_argument, 0, 'T'},
+  {"output", required_argument, 0, 'o'},
   {"strict-bpm", no_argument, 0, 's'},
   {"version", no_argument, 0, 'V'},
   {NULL, 0, NULL, 0}
 };
 
+#ifndef JACK_INTERNAL_CLIENT
 static void usage (int status) {
   printf ("jack_midi_clock - JACK app to generate MCLK from JACK transport.\n\n");
   printf ("Usage: jack_midi_clock [ OPTIONS ] [JACK-port]*\n\n");
@@ -521,16 +2196,40 @@ static void usage (int status) {
 "  -b <bpm>, --bpm <bpm>\n"
 "                         default BPM (if jack timecode master in not available)\n"
 "  -B, --force-bpm        ignore jack timecode master\n"
+"  -C <path>, --control <path>\n"
+"                         accept runtime parameter changes on a unix socket\n"
 "  -d <sec>, --resync-delay <sec>\n"
 "                         seconds between 'song-position' and 'continue' message\n"
+"  -f <port>, --follow <port>\n"
+"                         follow the tempo of MIDI clock or taps received from\n"
+"                         <port> ('' to only create the input port)\n"
 "  -J, --jitter-level <percent>\n"
 "                         add artificial jitter to the signal 0..20%%\n"
 "                         default: off (0)\n"
+"  -j, --jitter-profile <profile>[:<seed>]\n"
+"                         distribution of the jitter (uniform, gauss, usb,\n"
+"                         wander), default: uniform, random seed\n"
+"  -L, --latency          compensate for the playback latency of each output\n"
+"  -l <num>, --lookahead <num>\n"
+"                         pre-compute clock tick positions for <num> cycles\n"
+"                         at constant tempo, 0: off, default: 4\n"
+"  -o, --output <name>[,<setting>]*\n"
+"                         add an output port, may be given multiple times,\n"
+"                         see OUTPUTS below\n"
 "  -P, --no-position      do not send song-position (0xf2) messages\n"
 "  -T, --no-transport     do not send start/stop/continue messages\n"
+"  -U, --no-mlockall      only lock the memory used in realtime context,\n"
+"                         not the whole process\n"
 "  -s, --strict-bpm       interpret tempo strictly as beats per minute (default\n"
 "                         is quarter-notes per minute)\n"
+"  -S <sec>, --stats <sec>\n"
+"                         print realtime statistics every <sec> seconds\n"
+"  -F <file>, --stats-file <file>\n"
+"                         append statistics to the given file instead of stderr\n"
+"  -E <name>, --shm <name>\n"
+"                         export statistics in POSIX shared memory, e.g. /mclk\n"
 "  -h, --help             display this help and exit\n"
+"  -i, --interpolate      ramp tempo changes linearly over a cycle\n"
 "  -V, --version          print version information and exit\n"
 
 "\n");
@@ -560,10 +2259,100 @@ static void usage (int status) {
 "This delay can be configured with the -d option and is only relevant for if\n"
 "playback starts at a bar|beat|tick other than 1|1|0 in which case a 'start'\n"
 "message is sent immediately.\n"
+"The delay can also be set per output (resync=, see below), to use the\n"
+"shortest delay that each receiver can handle.\n"
+"\n"
+"Song-position is a 14 bit value: positions beyond 16384 MIDI beats (1024\n"
+"bars in 4/4) are not sent, unless the wrap-position setting of the output\n"
+"is given.\n"
+"\n"
+"OUTPUTS\n"
+"By default a single output port 'mclk_out' is created, and all ports given\n"
+"as additional arguments are connected to it. The -o option replaces it with\n"
+"one or more named output ports that share the same clock source. Each can be\n"
+"configured with a comma separated list of settings:\n"
+"  offset=<samples>      delay clock and transport messages of this port,\n"
+"                        negative values send the clock ahead of time\n"
+"  ppqn=<n>              clock ticks per quarter note (default: 24), e.g. 48\n"
+"                        or 96 for DIN sync or modular gear\n"
+"  divider=<n>           only send every n-th clock tick\n"
+"  resync=<sec>          delay between 'song-position' and 'continue' for this\n"
+"                        port (default: -d value)\n"
+"  wrap-position         wrap song-position at the last bar before 16384\n"
+"                        MIDI beats, instead of not sending it\n"
+"  no-position           do not send song-position messages on this port\n"
+"  no-transport          do not send start/stop/continue on this port\n"
+"  mtc=<fps>             also send MIDI Time Code of the transport position,\n"
+"                        fps is one of 24, 25, 29.97 (drop-frame) or 30\n"
+"  rawmidi=<device>      send to the given ALSA rawmidi device (e.g. hw:1,0)\n"
+"                        instead of a JACK port\n"
+"  net=<addr>[:<port>]   send clock, transport and song-position as UDP\n"
+"                        packets to the given (multicast) address instead of a\n"
+"                        JACK port, e.g. 239.255.0.24 (default port: 5224)\n"
+"  connect=<port>        connect this output to the given JACK port\n"
+"e.g. -o synth,offset=64,connect=system:midi_playback_1 -o drums,divider=2\n"
+"Additional port arguments are connected to the first output port.\n"
+"All outputs derive their clock from the same tick phase, which runs at the\n"
+"least common multiple of their ppqn (at most 960).\n"
+"MIDI Time Code is sent as quarter frames while rolling, and as full frame\n"
+"message after the transport is located or changes state. It is independent\n"
+"of the tempo, and delayed along with the clock of the port.\n"
+"Messages of rawmidi outputs are timestamped in process() and written to the\n"
+"device by a realtime thread one period later, the same time a JACK MIDI\n"
+"port would send them, without a bridge (e.g. a2jmidid) in between.\n"
+"Network outputs send one packet per message in the same way, carrying the\n"
+"absolute tick index, the tempo and the JACK time of the message, for\n"
+"machines in separate JACK graphs (see jack_mclk_dump -N, mclk_net.h).\n"
+"\n"
+"With the -L option, each output's clock is additionally sent ahead of time by\n"
+"the playback latency of the port (as reported by JACK, e.g. a2jmidid or\n"
+"the backend's MIDI latency), so that ticks arrive at the device on time.\n"
+"\n"
+"JACK reports one tempo per cycle. By default the clock tick interval changes\n"
+"at cycle boundaries. With the -i option, ticks are placed by integrating the\n"
+"tempo, ramping linearly from the previous cycle's tempo to the current one\n"
+"over the duration of the cycle. This avoids steps in the tick interval during\n"
+"accelerando/ritardando, in particular with large periods.\n"
+"\n"
+"The -S option enables periodic statistics: process cycles, cycles with\n"
+"transport rolling, clock ticks sent, cycles in which past ticks had to be\n"
+"skipped (e.g. after a tempo change), messages that could not be queued, and\n"
+"the maximum deviation of a tick from its nominal position (jitter, clamping).\n"
+"With -E, the same counters (since start), the current tempo and transport\n"
+"state are published 10 times per second in a POSIX shared memory segment,\n"
+"for monitoring tools. The layout is described in mclk_shm.h.\n"
+"\n"
+"The jitter (-J) is taken from a table that is computed at start, so the\n"
+"jitter sequence is reproducible if a seed is given (e.g. -j gauss:42).\n"
+"Profiles: uniform, gauss (normal distribution, clamped at 3 sigma), usb\n"
+"(late only, quantized to quarters of the level, in bursts) and wander (slow\n"
+"periodic drift over 512 ticks).\n"
+"\n"
+"The -f option creates an input port 'mclk_in' and derives the tempo from the\n"
+"MIDI clock (0xf8) or taps (note-on, one per quarter note) it receives, using\n"
+"a delay-locked loop to filter jitter. The followed tempo replaces the -b\n"
+"value: it is used if no timecode master is present, or always with -B.\n"
+"If no events arrive for longer than twice the period, the -b value is used.\n"
+"Start/stop of the source are not followed, use jack transport for that.\n"
+"\n"
+"The -C option creates a unix datagram socket that accepts one command per\n"
+"message to change parameters while running: 'bpm <bpm>', 'force-bpm 0|1',\n"
+"'position 0|1', 'transport 0|1' and 'jitter <percent>', e.g.\n"
+"echo 'bpm 128' | socat - UNIX-SENDTO:/tmp/mclk.sock\n"
+"\n"
+"The memory used in realtime context (ring buffers, output queues, tick\n"
+"schedule, statistics and the stacks of the realtime threads) is locked and\n"
+"prefaulted at startup. By default the whole process is locked as well, -U\n"
+"skips that to reduce the resident memory, e.g. when running many instances.\n"
 "\n"
 "jack_midi_clock runs until it receives a HUP or INT signal or jackd is\n"
 "terminated.\n"
 "\n"
+"jack_midi_clock is also available as internal client, which runs inside\n"
+"jackd. The same options and port arguments can be given as init string\n"
+"(separated by whitespace, without quoting), except -h, -V, -C and statistics,\n"
+"e.g. jack_load mclk jack_midi_clock -i \"-b 120 -P system:midi_playback_1\"\n"
+"\n"
 "See also: jack_transport(1), jack_mclk_dump(1)\n"
 
 "\n");
@@ -572,19 +2361,166 @@ static void usage (int status) {
 	  );
   exit (status);
 }
+#endif
+
+/**
+ * parse output port specification
+ * @param spec <name>[,<setting>]* -- modified in place
+ * @return 0 on success, -1 on error
+ */
+static int parse_output(char *spec) {
+  enum { OPT_OFFSET = 0, OPT_PPQN, OPT_DIVIDER, OPT_RESYNC, OPT_WRAP_POSITION, OPT_NO_POSITION, OPT_NO_TRANSPORT, OPT_MTC, OPT_RAWMIDI, OPT_NET, OPT_CONNECT };
+  char *const tokens[] = {
+    [OPT_OFFSET]       = "offset",
+    [OPT_PPQN]         = "ppqn",
+    [OPT_DIVIDER]      = "divider",
+    [OPT_RESYNC]       = "resync",
+    [OPT_WRAP_POSITION] = "wrap-position",
+    [OPT_NO_POSITION]  = "no-position",
+    [OPT_NO_TRANSPORT] = "no-transport",
+    [OPT_MTC]          = "mtc",
+    [OPT_RAWMIDI]      = "rawmidi",
+    [OPT_NET]          = "net",
+    [OPT_CONNECT]      = "connect",
+    NULL
+  };
+  struct mclk_output *o;
+  char *subopts = strchr(spec, ',');
+  char *value;
+
+  if (subopts) {
+    *subopts++ = '\0';
+  }
+  if (!*spec) {
+    fprintf(stderr, "Invalid output, port name is empty.\n");
+    return -1;
+  }
+  if (!(o = add_output(spec))) {
+    return -1;
+  }
+
+  while (subopts && *subopts) {
+    switch (getsubopt(&subopts, tokens, &value)) {
+      case OPT_OFFSET:
+	if (!value) goto missing;
+	o->offset = atoi(value);
+	break;
+      case OPT_PPQN:
+	if (!value) goto missing;
+	o->ppqn = atoi(value);
+	if (o->ppqn < 1 || o->ppqn > 96) {
+	  fprintf(stderr, "Invalid ppqn for output '%s', should be 1 <= ppqn <= 96. Using %d.\n", o->name, MCLK_PPQN);
+	  o->ppqn = MCLK_PPQN;
+	}
+	break;
+      case OPT_DIVIDER:
+	if (!value) goto missing;
+	o->divider = atoi(value);
+	if (o->divider < 1 || o->divider > 96) {
+	  fprintf(stderr, "Invalid divider for output '%s', should be 1 <= div <= 96. Using 1.\n", o->name);
+	  o->divider = 1;
+	}
+	break;
+      case OPT_RESYNC:
+	if (!value) goto missing;
+	o->resync_delay = atof(value);
+	if (o->resync_delay < 0 || o->resync_delay > 20) {
+	  fprintf(stderr, "Invalid resync delay for output '%s', should be 0 <= dly <= 20.0. Using -d value.\n", o->name);
+	  o->resync_delay = -1;
+	}
+	break;
+      case OPT_WRAP_POSITION:
+	o->wrap_position = 1;
+	break;
+      case OPT_NO_POSITION:
+	o->port_filter |= MSG_NO_POSITION;
+	break;
+      case OPT_NO_TRANSPORT:
+	o->port_filter |= MSG_NO_TRANSPORT;
+	break;
+      case OPT_MTC:
+	if (!value) goto missing;
+	if (!strcmp(value, "24")) {
+	  o->mtc_rate = MTC_24;
+	} else if (!strcmp(value, "25")) {
+	  o->mtc_rate = MTC_25;
+	} else if (!strcmp(value, "29.97") || !strcmp(value, "29")) {
+	  o->mtc_rate = MTC_29_97DF;
+	} else if (!strcmp(value, "30")) {
+	  o->mtc_rate = MTC_30;
+	} else {
+	  fprintf(stderr, "Invalid MTC rate for output '%s', should be 24, 25, 29.97 or 30.\n", o->name);
+	  return -1;
+	}
+	break;
+      case OPT_RAWMIDI:
+	if (!value) goto missing;
+#ifdef WITH_ALSA
+	o->rawmidi = value;
+	break;
+#else
+	fprintf(stderr, "Cannot use rawmidi for output '%s', compiled without ALSA support.\n", o->name);
+	return -1;
+#endif
+      case OPT_NET:
+	if (!value) goto missing;
+#ifndef WIN32
+	{
+	  struct sockaddr_in addr;
+	  if (mclk_net_addr(value, &addr)) {
+	    fprintf(stderr, "Invalid network address for output '%s', should be <IPv4 address>[:<port>].\n", o->name);
+	    return -1;
+	  }
+	}
+	o->net = value;
+	break;
+#else
+	fprintf(stderr, "Cannot use net for output '%s', not supported on this platform.\n", o->name);
+	return -1;
+#endif
+      case OPT_CONNECT:
+	if (!value) goto missing;
+	o->connect = value;
+	break;
+      default:
+	fprintf(stderr, "Unknown setting '%s' for output '%s'.\n", value, o->name);
+	return -1;
+    }
+  }
+  return 0;
+
+missing:
+  fprintf(stderr, "Missing value for setting of output '%s'.\n", o->name);
+  return -1;
+}
 
+/**
+ * parse commandline options
+ * @return index of the first non-option argument, -1 on error
+ */
 static int decode_switches (int argc, char **argv) {
   int c;
 
   while ((c = getopt_long (argc, argv,
 			   "b:"	/* bpm */
 			   "B"	/* force-bpm */
+			   "C:"	/* control */
 			   "d:"	/* resync-delay */
+			   "f:"	/* follow */
 			   "J:"	/* jittery output */
+			   "j:"	/* jitter-profile */
+			   "L"	/* latency compensation */
+			   "l:"	/* lookahead */
 			   "h"	/* help */
+			   "i"	/* interpolate */
 			   "P"	/* no-position */
 			   "T"	/* no-transport */
+			   "U"	/* no-mlockall */
+			   "o:"	/* output */
 			   "s"  /* strict-bpm */
+			   "S:"	/* stats */
+			   "F:"	/* stats-file */
+			   "E:"	/* shm */
 			   "V",	/* version */
 			   long_options, (int *) 0)) != EOF)
     {
@@ -597,6 +2533,15 @@ static int decode_switches (int argc, char **argv) {
 	  force_bpm = 1;
 	  break;
 
+	case 'C':
+	  ctrl_path = optarg;
+	  break;
+
+	case 'f':
+	  follow_tempo = 1;
+	  follow.connect = optarg;
+	  break;
+
 	case 'P':
 	  msg_filter |= MSG_NO_POSITION;
 	  break;
@@ -621,14 +2566,78 @@ static int decode_switches (int argc, char **argv) {
 #endif
 	  break;
 
+	case 'j':
+#ifdef WITH_JITTER
+	  {
+	    char *seed = strchr(optarg, ':');
+	    if (seed) {
+	      *seed++ = '\0';
+	      jitter_seed = strtoul(seed, NULL, 10);
+	    }
+	    for (jitter_profile = 0; jitter_profile_names[jitter_profile]; ++jitter_profile) {
+	      if (!strcmp(optarg, jitter_profile_names[jitter_profile])) break;
+	    }
+	    if (!jitter_profile_names[jitter_profile]) {
+	      fprintf(stderr, "Invalid jitter-profile '%s'.\n", optarg);
+	      return -1;
+	    }
+	  }
+#else
+	  fprintf(stderr, "This version was compiled without support for jitter.\n");
+#endif
+	  break;
+
+	case 'i':
+	  interpolate_tempo = 1;
+	  break;
+
+	case 'L':
+	  compensate_latency = 1;
+	  break;
+
+	case 'l':
+	  sched_cycles = atoi(optarg);
+	  if (sched_cycles < 0 || sched_cycles > 64) {
+	    fprintf(stderr, "Invalid lookahead, should be 0 <= cycles <= 64. Using 4.\n");
+	    sched_cycles = 4;
+	  }
+	  break;
+
 	case 'T':
 	  msg_filter |= MSG_NO_TRANSPORT;
 	  break;
 
+	case 'U':
+	  lock_all = 0;
+	  break;
+
+	case 'o':
+	  if (parse_output(optarg)) {
+	    return -1;
+	  }
+	  break;
+
         case 's':
           tempo_is_qnpm = 0;
           break;
 
+	case 'S':
+	  stats_interval = atof(optarg);
+	  if (stats_interval < 0 || stats_interval > 3600) {
+	    fprintf(stderr, "Invalid statistics interval, should be 0 <= sec <= 3600. Disabled.\n");
+	    stats_interval = 0;
+	  }
+	  break;
+
+	case 'F':
+	  stats_path = optarg;
+	  break;
+
+	case 'E':
+	  shm_name = optarg;
+	  break;
+
+#ifndef JACK_INTERNAL_CLIENT
 	case 'V':
 	  printf ("jack_midi_clock version %s\n\n", VERSION);
 	  printf ("Copyright (C) GPL 2013 Robin Gareus <robin@gareus.org>\n");
@@ -637,26 +2646,57 @@ static int decode_switches (int argc, char **argv) {
 
 	case 'h':
 	  usage (0);
+#endif
 
 	default:
-	  usage (EXIT_FAILURE);
+	  return -1;
       }
     }
 
   return optind;
 }
 
+#ifndef JACK_INTERNAL_CLIENT
+static void catchsig (int sig) {
+#ifndef _WIN32
+  signal(SIGHUP, catchsig);
+#endif
+  client_state = Exit;
+  wake_main_now();
+}
+
+/**************************
+ * main application code
+ */
+
 int main (int argc, char **argv) {
+  int i;
   memset(&last_xpos, 0, sizeof(struct bbtpos));
 
-  decode_switches (argc, argv);
+  if (decode_switches (argc, argv) < 0) {
+    usage (EXIT_FAILURE);
+  }
 
   if (init_jack("jack_midi_clock"))
     goto out;
   if (jack_portsetup())
     goto out;
+#ifdef HAVE_QUEUED_OUTPUTS
+  if (queue_start())
+    goto out;
+#endif
+
+  if ((stats_interval > 0 || shm_name) && stats_init())
+    goto out;
+
+  if (ctrl_path && ctrl_init())
+    goto out;
 
-  if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
+#ifdef WITH_JITTER
+  jitter_init();
+#endif
+
+  if (rt_lock()) {
     fprintf(stderr, "Warning: Can not lock memory.\n");
   }
 
@@ -665,8 +2705,12 @@ int main (int argc, char **argv) {
     goto out;
   }
 
+  for (i = 0; i < n_outputs; ++i)
+    port_connect(&outputs[i], outputs[i].connect);
+  follow_connect();
+
   while (optind < argc)
-    port_connect(argv[optind++]);
+    port_connect(&outputs[0], argv[optind++]);
 
 #ifndef _WIN32
   signal (SIGHUP, catchsig);
@@ -674,10 +2718,6 @@ int main (int argc, char **argv) {
 #endif
 
 
-#ifdef WITH_JITTER
-   _rseed =  jack_get_time ();
-   if (_rseed == 0) _rseed = 1;
-#endif
 
   wake_main_init();
 
@@ -696,29 +2736,107 @@ out:
 
 #else
 
+static char  *load_init_args = NULL;
+static char **load_init_argv = NULL;
+
+/**
+ * split the load_init string at whitespace into an argument vector,
+ * argv[0] is the client name. The strings remain valid until
+ * free_load_init() is called.
+ * @return number of arguments, -1 on error
+ */
+static int parse_load_init(const char *load_init) {
+  int argc = 1;
+  char *p;
+
+  if (!(load_init_args = strdup(load_init ? load_init : ""))) {
+    return -1;
+  }
+  if (!(load_init_argv = malloc((strlen(load_init_args) / 2 + 3) * sizeof(char *)))) {
+    return -1;
+  }
+  load_init_argv[0] = "jack_midi_clock";
+  for (p = strtok(load_init_args, " \t\n"); p; p = strtok(NULL, " \t\n")) {
+    load_init_argv[argc++] = p;
+  }
+  load_init_argv[argc] = NULL;
+  return argc;
+}
+
+static void free_load_init(void) {
+  free(load_init_argv);
+  free(load_init_args);
+  load_init_argv = NULL;
+  load_init_args = NULL;
+}
+
 __attribute__ ((visibility("default")))
 int jack_initialize(jack_client_t* client, const char* load_init);
 
 int jack_initialize(jack_client_t* client, const char* load_init) {
+  int argc, i;
   memset(&last_xpos, 0, sizeof(struct bbtpos));
 
-  // TODO parse load_init
+  /* same options as the standalone application, e.g.
+   * jack_load mclk jack_midi_clock -i "-b 120 -P system:midi_playback_1"
+   */
+  if ((argc = parse_load_init(load_init)) < 0) {
+    fprintf (stderr, "jack_midi_clock: out of memory.\n");
+    free_load_init();
+    return(1);
+  }
+  optind = 1;
+  if (decode_switches (argc, load_init_argv) < 0) {
+    fprintf (stderr, "jack_midi_clock: invalid options '%s'.\n", load_init ? load_init : "");
+    free_load_init();
+    return(1);
+  }
+  if (stats_interval > 0 || shm_name) {
+    fprintf (stderr, "jack_midi_clock: statistics are not available for the internal client.\n");
+  }
+  if (ctrl_path) {
+    fprintf (stderr, "jack_midi_clock: control socket is not available for the internal client.\n");
+  }
 
   j_client = client;
   jack_set_process_callback (client, process, 0);
 
-  if (jack_portsetup())
+  if (jack_portsetup()) {
+    free_load_init();
+    return(1);
+  }
+#ifdef HAVE_QUEUED_OUTPUTS
+  if (queue_start()) {
+    queue_stop();
+    free_load_init();
     return(1);
+  }
+#endif
+
+#ifdef WITH_JITTER
+  jitter_init();
+#endif
+
+  if (rt_lock()) {
+    fprintf(stderr, "Warning: Can not lock memory.\n");
+  }
 
   if (jack_activate (j_client)) {
     fprintf (stderr, "cannot activate client.\n");
+#ifdef HAVE_QUEUED_OUTPUTS
+    queue_stop();
+#endif
+    free_load_init();
     return(1);
   }
 
-#ifdef WITH_JITTER
-   _rseed =  jack_get_time ();
-   if (_rseed == 0) _rseed = 1;
-#endif
+  for (i = 0; i < n_outputs; ++i)
+    port_connect(&outputs[i], outputs[i].connect);
+  follow_connect();
+
+  while (optind < argc)
+    port_connect(&outputs[0], load_init_argv[optind++]);
+
 
   client_state = Run;
 
@@ -730,7 +2848,12 @@ void jack_finish(void* arg);
 
 void jack_finish(void* arg) {
   client_state = Exit;
+#ifdef HAVE_QUEUED_OUTPUTS
+  queue_stop();
+#endif
   j_client = NULL;
+  n_outputs = 0;
+  free_load_init();
 }
 
 #endif // JACK_INTERNAL_CLIENT
@@ -0,0 +1,270 @@
+/* JACK MIDI Beat Clock - clock math shared by generator and parser
+ *
+ * (C) 2013  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MCLK_CORE_H
+#define MCLK_CORE_H
+
+#include <stdint.h>
+#include <math.h>
+
+/* MIDI Beat Clock: 24 ticks per quarter note
+ * one MIDI-beat (unit of the song position pointer) = six MIDI clocks
+ * -> 4 MIDI-beats per quarter note
+ */
+#define MCLK_PPQN    (24)
+#define MCLK_PER_SPP (6)
+#define SPP_PER_QN   (MCLK_PPQN / MCLK_PER_SPP)
+#define SPP_RANGE    (16384) /* song position pointer is a 14 bit value */
+
+/**
+ * quarter notes per beat
+ *
+ * It is an industry convention that tempo, while reported as "beats
+ * per minute" is actually "quarter notes per minute" in many DAW's.
+ * However, some DAW's/musicians actually use beats per minute
+ * (using the definition of "beat" as the denomitor of the time
+ * signature). While it appears that the JACK transport's intent
+ * is the latter, it's totally up to the DAW to define the tempo/note
+ * relationship. Currently Ardour does "quarter notes per minute."
+ *
+ * Viz. https://community.ardour.org/node/1433
+ *      http://www.steinberg.net/forums/viewtopic.php?t=56065
+ *
+ * @param tempo_is_qnpm tempo is given in quarter notes per minute
+ * @param beat_type denominator of the time signature
+ */
+static inline double mclk_quarter_notes_per_beat(int tempo_is_qnpm, double beat_type) {
+  return tempo_is_qnpm ? 1.0 : (beat_type / 4.0);
+}
+
+/**
+ * MIDI clock interval
+ * @param samples_per_beat tempo [samples/beat]
+ * @param quarter_notes_per_beat see mclk_quarter_notes_per_beat()
+ * @param ppqn clock ticks per quarter note, usually MCLK_PPQN
+ * @return samples per MIDI clock tick
+ */
+static inline double mclk_tick_interval(double samples_per_beat, double quarter_notes_per_beat, int ppqn) {
+  return samples_per_beat / quarter_notes_per_beat / ppqn;
+}
+
+/**
+ * tempo of a MIDI clock
+ * @param samplerate sample rate [Hz]
+ * @param interval samples per MIDI clock tick
+ * @param ppqn clock ticks per quarter note, usually MCLK_PPQN
+ * @return quarter notes per minute
+ */
+static inline double mclk_bpm(double samplerate, double interval, int ppqn) {
+  return samplerate * 60.0 / (interval * ppqn);
+}
+
+/**
+ * song position (MIDI beats) of a bar|beat|tick position.
+ * Note: jack counts bars and beats starting at 1
+ */
+static inline int64_t mclk_song_pos(int32_t bar, int32_t beat, int32_t tick, float beats_per_bar, double ticks_per_beat) {
+  return SPP_PER_QN * ((bar - 1) * beats_per_bar + (beat - 1))
+    + floor(SPP_PER_QN * tick / ticks_per_beat);
+}
+
+/**
+ * wrap a song position into the range of the song position pointer.
+ * The position wraps at the last complete bar, so that bar
+ * boundaries are retained.
+ */
+static inline int64_t mclk_song_pos_wrap(int64_t pos, float beats_per_bar) {
+  const int bar_len = rint(SPP_PER_QN * beats_per_bar);
+  const int range = (bar_len > 0 && bar_len <= SPP_RANGE) ? SPP_RANGE - SPP_RANGE % bar_len : SPP_RANGE;
+  return pos % range;
+}
+
+/**
+ * bar|beat|MIDI-beat of a song position, for display.
+ * @param metrum quarter notes per bar
+ */
+static inline void mclk_song_pos_bbt(int spp, int metrum, int *bar, int *beat, int *sub) {
+  *bar  = 1 + spp / SPP_PER_QN / metrum;
+  *beat = 1 + (spp / SPP_PER_QN) % metrum;
+  *sub  = spp % SPP_PER_QN;
+}
+
+/* 2nd or 3rd order delay-locked loop to filter the period of
+ * (jittery) MIDI clock events, used by jack_mclk_dump to
+ * display the filtered tempo, and by jack_midi_clock to
+ * follow an external clock.
+ *
+ * The 3rd order loop also tracks the change of the period, so it
+ * follows tempo ramps without lag. With adaptive bandwidth the loop
+ * starts wide (DLL_WIDE times the given bandwidth), narrows as long
+ * as the error variance falls, and re-widens after a tempo step:
+ * DLL_STEP_TICKS consecutive errors of the same sign beyond
+ * DLL_STEP_SIGMA standard deviations. Long runs of errors of the
+ * same sign (ramps) widen it gradually.
+ */
+
+#define DLL_WIDE       (16.0) /**< initial bandwidth of the adaptive loop, relative to the given one */
+#define DLL_NARROW     (1.02) /**< narrowing factor per tick */
+#define DLL_STEP_SIGMA (4.0)
+#define DLL_STEP_TICKS (3)
+#define DLL_RUN_TICKS  (16)   /**< consecutive errors of the same sign that widen the loop */
+#define DLL_MAX_OMEGA  (0.5)  /**< stability limit of the 3rd order and adaptive loop */
+
+typedef struct {
+  double t0; ///< time of the current Mclk tick
+  double t1; ///< expected next Mclk tick
+  double e2; ///< second order loop error
+  double e3; ///< third order loop error
+  double b, c, d, omega; ///< DLL filter coefficients
+  int order;      ///< 2 or 3
+  int adaptive;   ///< adapt bandwidth
+  double bw;      ///< current inverse bandwidth [1/Hz]
+  double bw_min;  ///< narrowest inverse bandwidth [1/Hz]
+  double var;     ///< smoothed error variance [s^2], 0: unset
+  int step_cnt;   ///< consecutive outliers
+  int step_sign;  ///< sign of outliers
+  int run_cnt;    ///< consecutive errors of the same sign
+  int run_sign;   ///< sign of the previous error
+} DelayLockedLoop;
+
+/**
+ * calculate filter coefficients
+ * @param period period [1/Hz]
+ * @param bandwidth inverse loop bandwidth [1/Hz]
+ */
+static inline void dll_coefficients(DelayLockedLoop *dll, double period, double bandwidth) {
+  double omega = 2.0 * M_PI * period / bandwidth;
+  if ((dll->order == 3 || dll->adaptive) && omega > DLL_MAX_OMEGA) {
+    omega = DLL_MAX_OMEGA;
+  }
+  dll->omega = omega;
+  if (dll->order == 3) {
+    /* 3rd order Butterworth */
+    dll->b = 2.0 * omega;
+    dll->c = 2.0 * omega * omega;
+    dll->d = omega * omega * omega;
+  } else {
+    dll->b = 1.4142135623730950488 * omega;
+    dll->c = omega * omega;
+    dll->d = 0;
+  }
+}
+
+/**
+ * initialize DLL
+ * set current time and period in samples
+ * @param samplerate sample rate [Hz]
+ * @param bandwidth inverse loop bandwidth [1/Hz], narrowest if adaptive
+ * @param order 2 or 3
+ * @param adaptive adapt the bandwidth to the error
+ */
+static inline void init_dll_ext(DelayLockedLoop *dll, double tme, double period, double samplerate, double bandwidth, int order, int adaptive) {
+  dll->order    = order;
+  dll->adaptive = adaptive;
+  dll->bw_min   = bandwidth;
+  dll->bw       = adaptive ? bandwidth / DLL_WIDE : bandwidth;
+  dll->var      = 0;
+  dll->step_cnt = 0;
+  dll->step_sign = 0;
+  dll->run_cnt  = 0;
+  dll->run_sign = 0;
+  dll_coefficients(dll, period / samplerate, dll->bw);
+
+  dll->e2 = period / samplerate;
+  dll->e3 = 0;
+  dll->t0 = tme / samplerate;
+  dll->t1 = dll->t0 + dll->e2;
+}
+
+/**
+ * initialize 2nd order DLL with fixed bandwidth
+ * @param samplerate sample rate [Hz]
+ * @param bandwidth inverse loop bandwidth [1/Hz]
+ */
+static inline void init_dll(DelayLockedLoop *dll, double tme, double period, double samplerate, double bandwidth) {
+  init_dll_ext(dll, tme, period, samplerate, bandwidth, 2, 0);
+}
+
+/**
+ * adapt bandwidth to the error of the current iteration
+ * @param e error [1/Hz]
+ */
+static inline void adapt_dll(DelayLockedLoop *dll, double e) {
+  const double ee = e * e;
+  const int sign = e < 0 ? -1 : 1;
+
+  if (dll->var <= 0) {
+    dll->var = ee;
+  }
+
+  /* errors of white jitter change sign, a long run of the same sign
+   * means the loop is too narrow to follow the tempo (ramp) */
+  dll->run_cnt = (sign == dll->run_sign) ? dll->run_cnt + 1 : 1;
+  dll->run_sign = sign;
+  if (dll->run_cnt >= DLL_RUN_TICKS) {
+    dll->bw /= 1.5;
+    if (dll->bw < dll->bw_min / DLL_WIDE) {
+      dll->bw = dll->bw_min / DLL_WIDE;
+    }
+    dll->run_cnt = 0;
+  }
+
+  if (ee > DLL_STEP_SIGMA * DLL_STEP_SIGMA * dll->var && fabs(e) > 0.002 * dll->e2) {
+    /* outlier, tempo step if it persists */
+    dll->step_cnt = (sign == dll->step_sign) ? dll->step_cnt + 1 : 1;
+    dll->step_sign = sign;
+    if (dll->step_cnt >= DLL_STEP_TICKS) {
+      dll->bw = dll->bw_min / DLL_WIDE;
+      dll->var = ee;
+      dll->step_cnt = 0;
+    }
+  } else {
+    dll->step_cnt = 0;
+    if (ee < dll->var) {
+      dll->bw *= DLL_NARROW;
+      if (dll->bw > dll->bw_min) {
+	dll->bw = dll->bw_min;
+      }
+    }
+  }
+
+  dll->var += (ee - dll->var) / 16.0;
+  dll_coefficients(dll, dll->e2, dll->bw);
+}
+
+/**
+ * run one loop iteration.
+ * @param tme time of event (in samples)
+ * @param samplerate sample rate [Hz], same as for init_dll()
+ * @return smoothed interval (period) [1/Hz]
+ */
+static inline double run_dll(DelayLockedLoop *dll, double tme, double samplerate) {
+  const double e = tme / samplerate - dll->t1;
+  dll->t0 = dll->t1;
+  dll->t1 += dll->b * e + dll->e2;
+  dll->e2 += dll->c * e + dll->e3;
+  dll->e3 += dll->d * e;
+  if (dll->adaptive) {
+    adapt_dll(dll, e);
+  }
+  return (dll->t1 - dll->t0);
+}
+
+#endif
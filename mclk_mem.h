@@ -0,0 +1,119 @@
+/* JACK MIDI Beat Clock - locked memory for realtime threads
+ *
+ * (C) 2013  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* mlockall() pins every page of the process, including all shared
+ * libraries and every later allocation. The data used in realtime
+ * context is instead locked explicitly: static blocks and ring buffers
+ * with mclk_mem_lock(), dynamic blocks are allocated from an arena that
+ * is allocated, prefaulted and locked once at startup, and the stack of
+ * each realtime thread is locked by mclk_mem_lock_stack() when the
+ * thread starts. mlock() faults all pages in, so the realtime path does
+ * not page-fault on first use either.
+ */
+
+#ifndef MCLK_MEM_H
+#define MCLK_MEM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MCLK_STACK_LOCK (64 * 1024) /**< stack of realtime threads to lock [bytes] */
+#define MCLK_ARENA_ALIGN (64)       /**< alignment of arena allocations, cache line */
+
+struct mclk_arena {
+  uint8_t *base;
+  size_t   size;
+  size_t   used;
+};
+
+/**
+ * lock the pages that contain the given memory, and fault them in
+ * @return 0 on success, -1 on error (e.g. RLIMIT_MEMLOCK)
+ */
+static inline int mclk_mem_lock(const void *addr, size_t size) {
+  const uintptr_t pg = sysconf(_SC_PAGESIZE);
+  const uintptr_t start = (uintptr_t) addr & ~(pg - 1);
+  const uintptr_t end = ((uintptr_t) addr + size + pg - 1) & ~(pg - 1);
+  if (size == 0) {
+    return 0;
+  }
+  return mlock((const void *) start, end - start) ? -1 : 0;
+}
+
+/**
+ * prefault and lock the top MCLK_STACK_LOCK bytes of the calling
+ * thread's stack. The pages remain locked after this returns.
+ * @return 0 on success, -1 on error
+ */
+static inline int mclk_mem_lock_stack(void) {
+  volatile uint8_t stack[MCLK_STACK_LOCK];
+  memset((uint8_t *) stack, 0, sizeof(stack));
+  return mclk_mem_lock((const uint8_t *) stack, sizeof(stack));
+}
+
+/**
+ * allocate an arena, prefault and lock it
+ * @param size size of the arena [bytes]
+ * @return 0 on success, 1 if it could not be locked, -1 if it could not be allocated
+ */
+static inline int mclk_arena_init(struct mclk_arena *a, size_t size) {
+  memset(a, 0, sizeof(struct mclk_arena));
+  if (size == 0) {
+    return 0;
+  }
+  a->base = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (a->base == MAP_FAILED) {
+    a->base = NULL;
+    return -1;
+  }
+  a->size = size;
+  memset(a->base, 0, size);
+  return mlock(a->base, size) ? 1 : 0;
+}
+
+/**
+ * allocate zero-initialized memory from an arena. There is no free,
+ * all blocks are released with the arena.
+ * @return pointer to the block, NULL if the arena is exhausted
+ */
+static inline void *mclk_arena_alloc(struct mclk_arena *a, size_t size) {
+  const size_t sz = (size + MCLK_ARENA_ALIGN - 1) & ~((size_t) MCLK_ARENA_ALIGN - 1);
+  void *p;
+  if (!a->base || sz > a->size - a->used) {
+    return NULL;
+  }
+  p = a->base + a->used;
+  a->used += sz;
+  return p;
+}
+
+/**
+ * unlock and release an arena
+ */
+static inline void mclk_arena_free(struct mclk_arena *a) {
+  if (a->base) {
+    munmap(a->base, a->size);
+  }
+  memset(a, 0, sizeof(struct mclk_arena));
+}
+
+#endif
@@ -0,0 +1,194 @@
+/* JACK MIDI Beat Clock - network clock distribution via UDP multicast
+ *
+ * (C) 2013  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* jack_midi_clock sends one packet per clock tick, start, continue,
+ * stop and song position message of an output with a net=<addr>:<port>
+ * setting, at the time the message is due. jack_mclk_dump -N receives
+ * them, and re-emits the clock on a JACK port.
+ *
+ * packet: 32 bytes, all fields big-endian
+ *
+ *   0  magic     "MCLN"
+ *   4  version   u8, MCLK_NET_VERSION
+ *   5  msg       u8, MIDI status: 0xf8, 0xfa, 0xfb, 0xfc or 0xf2
+ *   6  song_pos  u16, song position [MIDI beats] for 0xf2, else 0
+ *   8  seq       u32, packet counter of the sender, to detect loss
+ *  12  tick      u64, clock ticks since song start (song position * ppqn / 4
+ *                plus ticks since start/continue), index of a 0xf8 tick
+ *  20  time      u64, due time of the message, sender's jack_get_time() [usec]
+ *  28  bpm       u32, tempo of the sender's transport [1/1000 BPM]
+ */
+
+#ifndef MCLK_NET_H
+#define MCLK_NET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MCLK_NET_VERSION (1)
+#define MCLK_NET_SIZE    (32)
+#define MCLK_NET_PORT    (5224)
+
+struct mclk_net_packet {
+  uint8_t  msg;
+  uint16_t song_pos;
+  uint32_t seq;
+  uint64_t tick;
+  uint64_t time;
+  double   bpm;
+};
+
+static inline void mclk_net_put(uint8_t *p, uint64_t v, int n) {
+  while (n-- > 0) {
+    p[n] = v & 0xff;
+    v >>= 8;
+  }
+}
+
+static inline uint64_t mclk_net_get(const uint8_t *p, int n) {
+  uint64_t v = 0;
+  while (n-- > 0) {
+    v = (v << 8) | *p++;
+  }
+  return v;
+}
+
+/**
+ * serialize a packet
+ * @param buf destination, MCLK_NET_SIZE bytes
+ */
+static inline void mclk_net_encode(uint8_t *buf, const struct mclk_net_packet *pk) {
+  memcpy(buf, "MCLN", 4);
+  buf[4] = MCLK_NET_VERSION;
+  buf[5] = pk->msg;
+  mclk_net_put(&buf[6], pk->song_pos, 2);
+  mclk_net_put(&buf[8], pk->seq, 4);
+  mclk_net_put(&buf[12], pk->tick, 8);
+  mclk_net_put(&buf[20], pk->time, 8);
+  mclk_net_put(&buf[28], pk->bpm > 0 ? (uint32_t) (pk->bpm * 1000.0 + .5) : 0, 4);
+}
+
+/**
+ * parse a received packet
+ * @return 0 on success, -1 if it is not a valid packet
+ */
+static inline int mclk_net_decode(const uint8_t *buf, size_t len, struct mclk_net_packet *pk) {
+  if (len < MCLK_NET_SIZE || memcmp(buf, "MCLN", 4) || buf[4] != MCLK_NET_VERSION) {
+    return -1;
+  }
+  pk->msg      = buf[5];
+  pk->song_pos = mclk_net_get(&buf[6], 2);
+  pk->seq      = mclk_net_get(&buf[8], 4);
+  pk->tick     = mclk_net_get(&buf[12], 8);
+  pk->time     = mclk_net_get(&buf[20], 8);
+  pk->bpm      = mclk_net_get(&buf[28], 4) / 1000.0;
+  return 0;
+}
+
+/**
+ * parse "<address>[:<port>]", numeric IPv4 only
+ * @return 0 on success, -1 on error
+ */
+static inline int mclk_net_addr(const char *spec, struct sockaddr_in *addr) {
+  char host[64];
+  const char *colon = strrchr(spec, ':');
+  const size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+  int port = MCLK_NET_PORT;
+
+  if (len == 0 || len >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, spec, len);
+  host[len] = '\0';
+  if (colon) {
+    port = atoi(colon + 1);
+    if (port < 1 || port > 65535) {
+      return -1;
+    }
+  }
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * open a socket to send packets to the given address
+ * @param ttl multicast time-to-live (hops)
+ * @return socket, -1 on error
+ */
+static inline int mclk_net_sender(const struct sockaddr_in *addr, int ttl) {
+  const unsigned char mttl = ttl;
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (IN_MULTICAST(ntohl(addr->sin_addr.s_addr))
+      && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * open a socket to receive packets sent to the given address,
+ * join the group if it is a multicast address.
+ * @return socket, -1 on error
+ */
+static inline int mclk_net_receiver(const struct sockaddr_in *addr) {
+  struct sockaddr_in local;
+  const int one = 1;
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&local, 0, sizeof(struct sockaddr_in));
+  local.sin_family = AF_INET;
+  local.sin_port = addr->sin_port;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *) &local, sizeof(local))) {
+    close(fd);
+    return -1;
+  }
+  if (IN_MULTICAST(ntohl(addr->sin_addr.s_addr))) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = addr->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+#endif
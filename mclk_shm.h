@@ -0,0 +1,175 @@
+/* JACK MIDI Beat Clock - statistics export via POSIX shared memory
+ *
+ * (C) 2013  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* jack_midi_clock and jack_mclk_dump publish their statistics in a
+ * shared memory segment when started with --shm <name>. The segment
+ * is written by a non-realtime thread and protected by a sequence
+ * lock: monitors copy it with mclk_shm_read() at any rate, and never
+ * block the writer.
+ *
+ * A segment starts with struct mclk_shm_header; 'type' tells which
+ * of the structs below follows. Fields are only appended to a struct
+ * for new versions, 'size' of the header is the size of the segment.
+ */
+
+#ifndef MCLK_SHM_H
+#define MCLK_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MCLK_SHM_MAGIC     (0x4b4c434d) /* "MCLK" */
+#define MCLK_SHM_VERSION   (1)
+#define MCLK_SHM_MAX_PORTS (16)
+
+enum MclkShmType {
+  MCLK_SHM_GENERATOR = 1, /**< struct mclk_shm_generator */
+  MCLK_SHM_DUMP      = 2  /**< struct mclk_shm_dump */
+};
+
+struct mclk_shm_header {
+  uint32_t magic;    /**< MCLK_SHM_MAGIC */
+  uint16_t version;  /**< MCLK_SHM_VERSION */
+  uint16_t type;     /**< MclkShmType */
+  uint32_t size;     /**< size of the segment [bytes] */
+  uint32_t seq;      /**< sequence lock, odd while an update is in progress */
+  uint64_t updates;  /**< number of updates */
+  uint64_t time;     /**< jack_get_time() of the last update [usec] */
+};
+
+/* jack_midi_clock, counters since start */
+struct mclk_shm_generator {
+  struct mclk_shm_header hdr;
+  uint32_t transport; /**< jack_transport_state_t of the last cycle */
+  uint32_t max_ticks; /**< max clock ticks per cycle and output */
+  double   bpm;       /**< tempo of the clock, 0: not sending clock */
+  uint64_t cycles;    /**< process cycles */
+  uint64_t rolling;   /**< cycles with transport rolling and known tempo */
+  uint64_t ticks;     /**< clock ticks sent, all outputs */
+  uint64_t catchup;   /**< cycles in which clock ticks were skipped */
+  uint64_t skipped;   /**< clock ticks that were skipped */
+  uint64_t failed;    /**< messages that could not be queued */
+  uint32_t max_dev;   /**< max deviation of a tick from its nominal position [samples] */
+  uint32_t reserved;
+};
+
+/* jack_mclk_dump, per input port */
+struct mclk_shm_port {
+  uint32_t rolling;  /**< 1 after start/continue, 0 after stop */
+  int32_t  song_pos; /**< song position of the last tick [MIDI beats], -1: unknown */
+  uint64_t ticks;    /**< clock ticks received */
+  double   bpm;      /**< tempo of the last clock interval, 0: unknown */
+  double   flt_bpm;  /**< DLL filtered tempo, 0: unknown */
+  double   dll_err;  /**< deviation of the last tick from the DLL prediction [usec] */
+  double   max_err;  /**< max absolute deviation from the DLL prediction [usec] */
+};
+
+struct mclk_shm_dump {
+  struct mclk_shm_header hdr;
+  uint32_t n_ports;  /**< valid entries in port[] */
+  uint32_t dropped;  /**< events dropped due to event queue overflow */
+  struct mclk_shm_port port[MCLK_SHM_MAX_PORTS];
+};
+
+/**
+ * create and map a segment
+ * @param name shm name, e.g. "/mclk"
+ * @param size size of the segment
+ * @param type MclkShmType
+ * @return pointer to the segment, NULL on error
+ */
+static inline void *mclk_shm_create(const char *name, size_t size, enum MclkShmType type) {
+  struct mclk_shm_header *h;
+  const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, size)) {
+    close(fd);
+    return NULL;
+  }
+  h = (struct mclk_shm_header *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    return NULL;
+  }
+  memset(h, 0, size);
+  h->magic   = MCLK_SHM_MAGIC;
+  h->version = MCLK_SHM_VERSION;
+  h->type    = type;
+  h->size    = size;
+  return h;
+}
+
+/**
+ * unmap and remove a segment
+ */
+static inline void mclk_shm_destroy(const char *name, void *shm) {
+  munmap(shm, ((struct mclk_shm_header *) shm)->size);
+  shm_unlink(name);
+}
+
+/**
+ * start an update, the sequence count becomes odd
+ */
+static inline void mclk_shm_write_begin(struct mclk_shm_header *h) {
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * complete an update, the sequence count becomes even
+ * @param time jack_get_time()
+ */
+static inline void mclk_shm_write_end(struct mclk_shm_header *h, uint64_t time) {
+  h->updates++;
+  h->time = time;
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * copy a consistent snapshot of a segment, for monitors.
+ * @param shm mapped segment
+ * @param copy destination, at least size bytes
+ * @param size bytes to copy
+ * @return 0 on success, -1 if the segment is invalid or could not be read
+ */
+static inline int mclk_shm_read(const void *shm, void *copy, size_t size) {
+  const struct mclk_shm_header *h = (const struct mclk_shm_header *) shm;
+  const struct mclk_shm_header *c = (const struct mclk_shm_header *) copy;
+  int retry;
+  for (retry = 0; retry < 1000; ++retry) {
+    const uint32_t s0 = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    if (s0 & 1) {
+      continue;
+    }
+    memcpy(copy, shm, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == s0) {
+      return (c->magic == MCLK_SHM_MAGIC && c->version == MCLK_SHM_VERSION) ? 0 : -1;
+    }
+  }
+  return -1;
+}
+
+#endif
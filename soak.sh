@@ -0,0 +1,248 @@
+#!/bin/sh
+# JACK MIDI Beat Clock - end-to-end soak test
+#
+# (C) 2013  Robin Gareus <robin@gareus.org>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# Starts a private jackd with the dummy backend for each period size,
+# connects jack_midi_clock's mclk_out to jack_mclk_dump's mclk_in and
+# drives the transport with jack_transport (as timebase master) through
+# a scripted set of tempos and locates, once per jitter level.
+#
+# The results are taken from the statistics both tools export with -E
+# (see mclk_shm.h) and the dump's TOTAL summary (-s):
+#   lost    clock ticks sent by the generator but not received by the dump
+#   drop    events dropped by either tool (queue overflow)
+#   drift   worst deviation of the dump's DLL filtered tempo from the
+#           transport tempo, at the end of each step [ppm]. The filtered
+#           tempo carries the part of the jitter the loop passes through,
+#           about 200 ppm per % of gauss jitter at 60 BPM with the dump's
+#           default bandwidth, so the limit grows with the jitter level.
+#   p99/max deviation of the received ticks from the DLL prediction [usec]
+#
+# Requires jackd, jack_lsp and jack_transport (jack example tools).
+# Settings are taken from the environment:
+#   SOAK_PERIODS    period sizes (default: "64 256 1024")
+#   SOAK_JITTER     generator jitter levels [%] (default: "0 5 15")
+#   SOAK_TEMPOS     tempos after the initial 120 BPM (default: "60 174 90.5 240")
+#   SOAK_STEP       duration of each step [sec] (default: 8)
+#   SOAK_RATE       sample rate (default: 48000)
+#   SOAK_MAX_DRIFT  fail if the drift exceeds this [ppm] (default: 500)
+#   SOAK_DRIFT_JITTER  added to the drift limit per % jitter [ppm] (default: 600)
+#   SOAK_MAX_ERR    fail if the max. deviation exceeds this [usec] (default: no limit)
+#   JACKD           jackd executable and server options (default: "jackd")
+#
+# Exits with status 1 if any run lost or dropped events or exceeded a limit.
+
+PERIODS=${SOAK_PERIODS:-"64 256 1024"}
+JITTER=${SOAK_JITTER:-"0 5 15"}
+TEMPOS=${SOAK_TEMPOS:-"60 174 90.5 240"}
+STEP=${SOAK_STEP:-8}
+RATE=${SOAK_RATE:-48000}
+MAX_DRIFT=${SOAK_MAX_DRIFT:-500}
+DRIFT_JITTER=${SOAK_DRIFT_JITTER:-600}
+MAX_ERR=${SOAK_MAX_ERR:-0}
+JACKD=${JACKD:-jackd}
+
+BINDIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/mclk_soak.XXXXXX") || exit 1
+JACK_DEFAULT_SERVER=mclk_soak_$$
+export JACK_DEFAULT_SERVER
+SHM_GEN=mclk_soak_gen_$$
+SHM_DUMP=mclk_soak_dump_$$
+
+for tool in jack_lsp jack_transport; do
+	if ! command -v $tool > /dev/null; then
+		echo "$tool not found (jack example tools)." >&2
+		exit 1
+	fi
+done
+
+JACKD_PID=
+GEN_PID=
+DUMP_PID=
+XPORT_PID=
+
+stop_clients () {
+	exec 3>&- 2> /dev/null
+	for pid in $GEN_PID $DUMP_PID $XPORT_PID; do
+		kill -HUP $pid 2> /dev/null
+	done
+	for pid in $GEN_PID $DUMP_PID $XPORT_PID; do
+		wait $pid 2> /dev/null
+	done
+	GEN_PID= DUMP_PID= XPORT_PID=
+}
+
+stop_all () {
+	stop_clients
+	if test -n "$JACKD_PID"; then
+		kill $JACKD_PID 2> /dev/null
+		wait $JACKD_PID 2> /dev/null
+	fi
+	JACKD_PID=
+}
+
+trap 'stop_all; rm -rf "$WORK"; exit 1' HUP INT TERM
+
+# wait until a port exists, $1: port name
+wait_port () {
+	n=0
+	while ! jack_lsp 2> /dev/null | grep -qx "$1"; do
+		n=$((n + 1))
+		if test $n -gt 50; then
+			echo "timeout waiting for port '$1'." >&2
+			return 1
+		fi
+		sleep .1
+	done
+}
+
+# read a field of a shm segment, $1: name, $2: offset, $3: od type (u4, u8, f8)
+shm_get () {
+	od -A n -j $2 -N ${3#?} -t $3 "/dev/shm/$1" | tr -d ' '
+}
+
+# copy a consistent snapshot of a segment to $WORK/$1 (see mclk_shm_read)
+shm_snap () {
+	n=0
+	while test $n -lt 100; do
+		s0=$(shm_get $1 12 u4)
+		cp "/dev/shm/$1" "$WORK/$1" || return 1
+		s1=$(shm_get $1 12 u4)
+		if test "$s0" = "$s1" && test $((s0 % 2)) -eq 0; then
+			return 0
+		fi
+		n=$((n + 1))
+	done
+	return 1
+}
+
+# field of the last snapshot, $1: name, $2: offset, $3: od type
+snap_get () {
+	od -A n -j $2 -N ${3#?} -t $3 "$WORK/$1" | tr -d ' '
+}
+
+# send a command to jack_transport
+xport () {
+	echo "$*" >&3
+}
+
+# run a step at the given tempo, record the drift of the dump's DLL
+step () {
+	sleep $STEP
+	shm_snap $SHM_DUMP || return
+	flt=$(snap_get $SHM_DUMP 64 f8)
+	awk -v f="$flt" -v b="$1" 'BEGIN {
+		d = 1e6 * (f - b) / b; if (d < 0) d = -d; printf "%.1f\n", d
+	}' >> "$WORK/drift"
+}
+
+# one run, $1: period size, $2: jitter level
+soak_run () {
+	: > "$WORK/drift"
+	"$BINDIR/jack_mclk_dump" -q -a -s $STEP -E /$SHM_DUMP > "$WORK/dump.log" 2>&1 &
+	DUMP_PID=$!
+	wait_port jack_mclk_dump:mclk_in || { stop_clients; return 1; }
+	"$BINDIR/jack_midi_clock" -J $2 -j gauss:$1 -E /$SHM_GEN jack_mclk_dump:mclk_in > "$WORK/gen.log" 2>&1 &
+	GEN_PID=$!
+	wait_port jack_midi_clock:mclk_out || { stop_clients; return 1; }
+
+	rm -f "$WORK/xport"
+	mkfifo "$WORK/xport"
+	jack_transport < "$WORK/xport" > /dev/null 2>&1 &
+	XPORT_PID=$!
+	exec 3> "$WORK/xport"
+
+	# scripted transport: start, tempo changes, locate while rolling, stop/restart
+	xport master
+	xport tempo 120
+	xport locate 0
+	xport play
+	step 120
+	for bpm in $TEMPOS; do
+		xport tempo $bpm
+		step $bpm
+	done
+	xport locate $((RATE * 60))
+	step $bpm
+	xport stop
+	sleep 1
+	xport locate 0
+	xport play
+	step $bpm
+	xport stop
+	sleep 1
+
+	if ! shm_snap $SHM_GEN || ! shm_snap $SHM_DUMP; then
+		echo "cannot read the statistics of period $1, jitter $2." >&2
+		stop_clients
+		return 1
+	fi
+	sent=$(snap_get $SHM_GEN 64 u8)
+	failed=$(snap_get $SHM_GEN 88 u8)
+	recv=$(snap_get $SHM_DUMP 48 u8)
+	dropped=$(snap_get $SHM_DUMP 36 u4)
+
+	xport exit
+	stop_clients
+
+	total=$(grep '^TOTAL' "$WORK/dump.log")
+	p99=$(echo "$total" | sed -n 's/.* p99: \([0-9.]*\) .*/\1/p')
+	max=$(echo "$total" | sed -n 's/.* max: \([0-9.]*\) .*/\1/p')
+	drift=$(sort -n "$WORK/drift" | tail -n 1)
+
+	printf "%6d %6s %8s %8s %6d %6d %10s %10s %10s" \
+		$1 $2 $sent $recv $((sent - recv)) $((failed + dropped)) ${drift:-?} ${p99:-?} ${max:-?}
+	fail=0
+	if test $((sent - recv)) -ne 0 || test $((failed + dropped)) -ne 0 || test -z "$max"; then
+		fail=1
+	fi
+	if awk -v d="${drift:-1e9}" -v m="$MAX_DRIFT" -v k="$DRIFT_JITTER" -v j="$2" \
+		'BEGIN { exit !(d > m + k * j) }'; then
+		fail=1
+	fi
+	if test "$MAX_ERR" != 0 && awk -v e="$max" -v m="$MAX_ERR" 'BEGIN { exit !(e > m) }'; then
+		fail=1
+	fi
+	if test $fail -ne 0; then
+		echo "  FAIL"
+	else
+		echo
+	fi
+	return $fail
+}
+
+printf "%6s %6s %8s %8s %6s %6s %10s %10s %10s\n" \
+	"period" "jitter" "sent" "recv" "lost" "drop" "drift[ppm]" "p99[usec]" "max[usec]"
+
+status=0
+for period in $PERIODS; do
+	$JACKD -n $JACK_DEFAULT_SERVER -d dummy -r $RATE -p $period > "$WORK/jackd.log" 2>&1 &
+	JACKD_PID=$!
+	n=0
+	while ! jack_lsp > /dev/null 2>&1 && test $n -lt 50; do
+		n=$((n + 1))
+		sleep .1
+	done
+	if ! jack_lsp > /dev/null 2>&1; then
+		echo "cannot start jackd, see below." >&2
+		cat "$WORK/jackd.log" >&2
+		stop_all
+		status=1
+		break
+	fi
+	for jitter in $JITTER; do
+		if ! soak_run $period $jitter; then
+			status=1
+		fi
+	done
+	stop_all
+done
+
+rm -rf "$WORK"
+exit $status